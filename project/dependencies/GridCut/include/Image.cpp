@@ -12,8 +12,12 @@
 
 #include "Image.h"
 
+#include <immintrin.h>
+
 #include <iostream>
 
+#include "ImageCpu.h"
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -56,28 +60,108 @@ std::ostream& operator<<(std::ostream& os, const RGB& rgb) {
   return os;
 }
 
-template <>
-Image<RGB> imread(const std::string& fileName) {
-  Image<RGB> empty;
-
+/// <summary>
+/// Decodes the file to 8-bit channels. Grey files are decoded to one
+/// channel, the others to RGB.
+/// </summary>
+/// <param name="fileName">Image file</param>
+/// <param name="width">Image width</param>
+/// <param name="height">Image height</param>
+/// <param name="channels">Channels of the decoded data, 1 or 3</param>
+/// <param name="grey">Keep one channel of grey files</param>
+/// <returns>Decoded data freed by stbi_image_free or NULL</returns>
+static unsigned char* loadBytes(const std::string& fileName, int* width,
+                                int* height, int* channels, bool grey) {
   FILE* file = fopen(fileName.c_str(), "rb");
 
   if (!file) {
-    return empty;
+    return NULL;
   }
 
-  int width;
-  int height;
-
-  const unsigned char* data = stbi_load_from_file(file, &width, &height, 0, 3);
+  int comp = 3;
+  if (grey && stbi_info_from_file(file, width, height, &comp) == 1) {
+    // grey with alpha is grey too
+    comp = comp <= 2 ? 1 : 3;
+  } else {
+    comp = 3;
+  }
+  unsigned char* data = stbi_load_from_file(file, width, height, 0, comp);
 
   fclose(file);
 
   if (data == NULL) {
-    return empty;
+    return NULL;
   }
-  if (width < 1 || height < 1) {
-    return empty;
+  if (*width < 1 || *height < 1) {
+    stbi_image_free((void*)data);
+    return NULL;
+  }
+  *channels = comp;
+  return data;
+}
+
+/// <summary>
+/// Averages the RGB bytes to grey, the arithmetic is the one of the RGB
+/// image, (r / 255 + g / 255 + b / 255) / 3.
+/// </summary>
+/// <param name="data">RGB bytes</param>
+/// <param name="out">Grey values</param>
+/// <param name="from">First pixel</param>
+/// <param name="to">Pixel after the last one</param>
+static void rgbToGrey(const unsigned char* data, float* out, size_t from,
+                      size_t to) {
+  for (size_t i = from; i < to; i++) {
+    const unsigned char* p = data + 3 * i;
+    out[i] = (float(p[0]) / 255.0f + float(p[1]) / 255.0f +
+              float(p[2]) / 255.0f) /
+             3.0f;
+  }
+}
+
+/// <summary>
+/// AVX2 version of rgbToGrey, eight pixels are converted at once. The
+/// division is exact in both versions, so the results are equal.
+/// </summary>
+/// <param name="data">RGB bytes</param>
+/// <param name="out">Grey values</param>
+/// <param name="count">Count of the pixels</param>
+IMAGE_TARGET_AVX2 static void rgbToGreyAVX2(const unsigned char* data,
+                                            float* out, size_t count) {
+  // channels of four pixels, r0..r3 g0..g3 b0..b3
+  const __m128i split =
+      _mm_setr_epi8(0, 3, 6, 9, 1, 4, 7, 10, 2, 5, 8, 11, -1, -1, -1, -1);
+  const __m256 v255 = _mm256_set1_ps(255.0f), v3 = _mm256_set1_ps(3.0f);
+  size_t i = 0;
+  // the second load reads four bytes after the eight pixels
+  for (; i + 10 <= count; i += 8) {
+    const unsigned char* p = data + 3 * i;
+    __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), split);
+    __m128i hi =
+        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 12)), split);
+    __m128i rg = _mm_unpacklo_epi32(lo, hi);  // r0..r7 g0..g7
+    __m128i bb = _mm_unpackhi_epi32(lo, hi);  // b0..b7
+    __m256 r = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(rg));
+    __m256 g = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(rg, 8)));
+    __m256 b = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bb));
+    __m256 sum = _mm256_add_ps(
+        _mm256_add_ps(_mm256_div_ps(r, v255), _mm256_div_ps(g, v255)),
+        _mm256_div_ps(b, v255));
+    _mm256_storeu_ps(out + i, _mm256_div_ps(sum, v3));
+  }
+  rgbToGrey(data, out, i, count);
+}
+
+template <>
+Image<RGB> imread(const std::string& fileName) {
+  int width;
+  int height;
+  int channels;
+
+  const unsigned char* data =
+      loadBytes(fileName, &width, &height, &channels, false);
+
+  if (data == NULL) {
+    return Image<RGB>();
   }
 
   Image<RGB> image(width, height);
@@ -98,18 +182,36 @@ Image<RGB> imread(const std::string& fileName) {
 
 template <>
 Image<float> imread(const std::string& fileName) {
-  Image<RGB> rgbImage = imread<RGB>(fileName);
-  if (rgbImage.width() < 1 || rgbImage.height() < 1) {
+  int width;
+  int height;
+  int channels;
+
+  // the bytes are converted directly, no RGB image is created
+  const unsigned char* data =
+      loadBytes(fileName, &width, &height, &channels, true);
+
+  if (data == NULL) {
     return Image<float>();
   }
 
-  Image<float> image(rgbImage.width(), rgbImage.height());
+  Image<float> image(width, height);
+  size_t count = (size_t)width * (size_t)height;
 
-  for (int y = 0; y < image.height(); y++)
-    for (int x = 0; x < image.width(); x++) {
-      RGB color = rgbImage(x, y);
-      image(x, y) = (color.r + color.g + color.b) / 3.0f;
+  if (channels == 1) {
+    // the grey value is repeated in all channels of the RGB average
+    float grey[256];
+    for (int v = 0; v < 256; v++) {
+      float c = float(v) / 255.0f;
+      grey[v] = (c + c + c) / 3.0f;
     }
+    for (size_t i = 0; i < count; i++) image.data()[i] = grey[data[i]];
+  } else if (imageHasAVX2()) {
+    rgbToGreyAVX2(data, image.data(), count);
+  } else {
+    rgbToGrey(data, image.data(), 0, count);
+  }
+
+  stbi_image_free((void*)data);
 
   return image;
 }
@@ -160,20 +262,54 @@ unsigned char* memFile(const Image<unsigned char>& image, int* len) {
   const int width = image.width();
   const int height = image.height();
 
-  unsigned char* const data =
-      new unsigned char[(size_t)width * (size_t)height * 3];
+  // masks and layers use few grey levels, they are stored as packed indices
+  const unsigned char* const pixels = image.data();
+  const size_t size = (size_t)width * (size_t)height;
+  bool used[256] = {false};
+  for (size_t i = 0; i < size; i++) used[pixels[i]] = true;
+
+  unsigned char index[256];
+  unsigned char palette[16 * 3];
+  int colors = 0;
+  for (int v = 0; v < 256 && colors <= 16; v++) {
+    if (!used[v]) continue;
+    if (colors < 16) {
+      index[v] = (unsigned char)colors;
+      palette[colors * 3 + 0] = palette[colors * 3 + 1] =
+          palette[colors * 3 + 2] = (unsigned char)v;
+    }
+    colors++;
+  }
 
-  for (int y = 0; y < height; y++)
+  if (colors > 16) {
+    return stbi_write_png_to_mem(pixels, width, width, height, 1, len);
+  }
+
+  const int depth = colors <= 2 ? 1 : colors <= 4 ? 2 : 4;
+  // black and white images need no palette
+  const bool grey = colors == (int)used[0] + (int)used[255];
+  if (grey) {
+    index[0] = 0;
+    index[255] = 1;
+  }
+
+  const int stride = (width * depth + 7) / 8;
+  unsigned char* const data = new unsigned char[(size_t)stride * height]();
+  assert(data != nullptr);
+
+  for (int y = 0; y < height; y++) {
+    const unsigned char* src = pixels + (size_t)y * width;
+    unsigned char* row = data + (size_t)y * stride;
     for (int x = 0; x < width; x++) {
-      const int xy = x + y * width;
-      unsigned char grey = image(x, y);
-      data[xy * 3 + 0] = grey;
-      data[xy * 3 + 1] = grey;
-      data[xy * 3 + 2] = grey;
+      const int bit = x * depth;
+      row[bit >> 3] |= index[src[x]] << (8 - depth - (bit & 7));
     }
+  }
 
-  unsigned char* ret;
-  ret = stbi_write_png_to_mem(data, width * 3, width, height, 3, len);
+  unsigned char* ret =
+      stbi_write_png_packed_to_mem(data, stride, width, height, depth,
+                                   grey ? nullptr : palette,
+                                   grey ? 0 : colors, len);
 
   delete[] data;
 
@@ -191,16 +327,43 @@ unsigned char* memFile(const Image<RGB>& image, int* len) {
   unsigned char* const data =
       new unsigned char[(size_t)width * (size_t)height * 3];
 
-  for (int y = 0; y < height; y++)
-    for (int x = 0; x < width; x++) {
-      const int xy = x + y * width;
+  // the channels are saturated, values out of [0, 1] would wrap around
+  auto toByte = [](float value) {
+    return (unsigned char)std::min(255.0f, std::max(0.0f, value * 255.0f));
+  };
+  const size_t count = (size_t)width * (size_t)height;
+  for (size_t i = 0; i < count; i++) {
+    const RGB& color = image.data()[i];
+    data[i * 3 + 0] = toByte(color.r);
+    data[i * 3 + 1] = toByte(color.g);
+    data[i * 3 + 2] = toByte(color.b);
+  }
 
-      const RGB color = image(x, y);
+  unsigned char* ret;
+  ret = stbi_write_png_to_mem(data, width * 3, width, height, 3, len);
 
-      data[xy * 3 + 0] = color.r * 255.0f;
-      data[xy * 3 + 1] = color.g * 255.0f;
-      data[xy * 3 + 2] = color.b * 255.0f;
-    }
+  delete[] data;
+
+  return ret;
+}
+
+template <>
+unsigned char* memFile(const Image<RGBA8>& image, int* len) {
+  if (image.width() < 1 || image.height() < 1) {
+    return nullptr;
+  }
+  const int width = image.width();
+  const int height = image.height();
+  const size_t count = (size_t)width * (size_t)height;
+
+  // the alpha is opaque, the PNG is stored as RGB
+  unsigned char* const data = new unsigned char[count * 3];
+  const RGBA8* pixels = image.data();
+  for (size_t i = 0; i < count; i++) {
+    data[i * 3 + 0] = pixels[i].r;
+    data[i * 3 + 1] = pixels[i].g;
+    data[i * 3 + 2] = pixels[i].b;
+  }
 
   unsigned char* ret;
   ret = stbi_write_png_to_mem(data, width * 3, width, height, 3, len);
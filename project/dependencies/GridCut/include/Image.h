@@ -15,9 +15,12 @@
 
 #include <assert.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <iostream>
 #include <string>
+#include <utility>
 
 /// <summary>
 /// Struct from GridCut library. Represents RGB color in [0-1] range.
@@ -38,6 +41,24 @@ bool operator==(const RGB& u, const RGB& v);
 bool operator!=(const RGB& u, const RGB& v);
 std::ostream& operator<<(std::ostream& os, const RGB& rgb);
 
+/// <summary>
+/// Color with 8-bit channels. The byte order is the one of the PNG files and
+/// of the locked ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE bitmaps.
+/// </summary>
+struct RGBA8 {
+  unsigned char r, g, b, a;
+};
+
+/// <summary>
+/// Counter of the bytes copied by the copy constructors and assignments of
+/// the images, the copies avoided by moves and views do not count.
+/// </summary>
+/// <returns>Copied bytes</returns>
+inline std::atomic<unsigned long long>& imageBytesCopied() {
+  static std::atomic<unsigned long long> bytes(0);
+  return bytes;
+}
+
 /// <summary>
 /// Struct from GridCut library. Represents the image.
 /// </summary>
@@ -57,36 +78,46 @@ class Image {
     _height = image._height;
 
     if (_width > 0 && _height > 0) {
-      _data = new T[_width * _height];
-      for (int i = 0; i < _width * _height; i++) {
-        _data[i] = image._data[i];
-      }
+      _data = new T[(size_t)_width * (size_t)_height];
+      copy(image);
     } else {
       _data = 0;
     }
   }
+  Image(Image<T>&& image) noexcept
+      : _width(image._width), _height(image._height), _data(image._data) {
+    image._width = 0;
+    image._height = 0;
+    image._data = 0;
+  }
   ~Image() { delete[] _data; }
 
   Image<T>& operator=(const Image<T>& image) {
     if (this != &image) {
-      if (_width == image._width && _height == image._height) {
-        for (int i = 0; i < _width * _height; i++) {
-          _data[i] = image._data[i];
-        }
-      } else {
+      // the buffer is reused for the same count of pixels
+      if ((size_t)_width * _height != (size_t)image._width * image._height) {
         delete[] _data;
-        _width = image._width;
-        _height = image._height;
-
+        _data = 0;
         if (image._width > 0 && image._height > 0) {
-          _data = new T[_width * _height];
-          for (int i = 0; i < _width * _height; i++) {
-            _data[i] = image._data[i];
-          }
-        } else {
-          _data = 0;
+          _data = new T[(size_t)image._width * (size_t)image._height];
         }
       }
+      _width = image._width;
+      _height = image._height;
+      if (_data != 0) copy(image);
+    }
+    return *this;
+  }
+
+  Image<T>& operator=(Image<T>&& image) noexcept {
+    if (this != &image) {
+      delete[] _data;
+      _width = image._width;
+      _height = image._height;
+      _data = image._data;
+      image._width = 0;
+      image._height = 0;
+      image._data = 0;
     }
     return *this;
   }
@@ -117,6 +148,53 @@ class Image {
     _data = new RGB[_width * _height];
   }
 
+  void swap(Image<T>& image) {
+    std::swap(_width, image._width);
+    std::swap(_height, image._height);
+    std::swap(_data, image._data);
+  }
+
+ private:
+  void copy(const Image<T>& image) {
+    size_t count = (size_t)_width * (size_t)_height;
+    std::copy(image._data, image._data + count, _data);
+    imageBytesCopied() += count * sizeof(T);
+  }
+
+  int _width;
+  int _height;
+  T* _data;
+};
+
+/// <summary>
+/// Image data borrowed from an image or another buffer. The view does not
+/// own the data and is passed by value, the data must outlive it.
+/// </summary>
+/// <typeparam name="T">Color data, const for read only views</typeparam>
+template <typename T>
+class ImageView {
+ public:
+  ImageView(T* data, int width, int height)
+      : _width(width), _height(height), _data(data) {}
+  template <typename U>
+  ImageView(Image<U>& image)
+      : _width(image.width()), _height(image.height()), _data(image.data()) {}
+  template <typename U>
+  ImageView(const Image<U>& image)
+      : _width(image.width()), _height(image.height()), _data(image.data()) {}
+
+  inline T& operator()(int x, int y) const {
+    assert(_data != 0);
+    assert(x >= 0 && x < _width && y >= 0 && y < _height);
+
+    return _data[x + y * _width];
+  }
+
+  int width() const { return _width; }
+  int height() const { return _height; }
+
+  T* data() const { return _data; }
+
  private:
   int _width;
   int _height;
@@ -143,7 +221,9 @@ template <typename T>
 bool imwrite(const Image<T>& image, const std::string& fileName);
 
 /// <summary>
-/// Converts image structure to PNG file in memory.
+/// Converts image structure to PNG file in memory. Grey images with at most
+/// 16 levels are stored with 1, 2 or 4 bits per pixel, black and white ones
+/// as greyscale and the others with a palette.
 /// </summary>
 /// <typeparam name="T"></typeparam>
 /// <param name="image"></param>
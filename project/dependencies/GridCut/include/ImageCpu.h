@@ -0,0 +1,48 @@
+// Basic utility code for working with images
+// Written by Tomas Cicvarek at the Czech Technical University in Prague
+
+// This software is in the public domain. Where that dedication is not
+// recognized, you are granted a perpetual, irrevocable license to copy
+// and modify this file however you want.
+
+// Processor checks of the image kernels, kept with the image code so that
+// it does not depend on the application headers.
+
+#ifndef IMAGE_CPU_H_
+#define IMAGE_CPU_H_
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// AVX2 kernels are always compiled and selected at runtime by imageHasAVX2
+#if defined(_MSC_VER)
+#define IMAGE_TARGET_AVX2
+#else
+#define IMAGE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+/// <summary>
+/// Checks whether the processor and the system support AVX2 instructions.
+/// </summary>
+/// <returns>AVX2 support</returns>
+inline bool imageHasAVX2() {
+  static const bool avx2 = []() {
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7) return false;
+    // AVX has to be enabled by the system to save the registers
+    __cpuid(regs, 1);
+    if ((regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0) return false;
+    if ((_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+  }();
+  return avx2;
+}
+
+#endif  // IMAGE_CPU_H_
@@ -1238,11 +1238,30 @@ static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes,
   }
 }
 
-STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels,
-                                              int stride_bytes, int x, int y,
-                                              int n, int *out_len) {
+// Whether the row y of the written image equals the previous one. Layers are
+// mostly constant, so their rows are encoded without running the filters.
+static int stbiw__png_row_repeats(const unsigned char *pixels,
+                                  int stride_bytes, int width, int height,
+                                  int y, int n) {
+  const unsigned char *z =
+      pixels +
+      stride_bytes * (stbi__flip_vertically_on_write ? height - 1 - y : y);
+  int signed_stride =
+      stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
+  return memcmp(z, z - signed_stride, width * n) == 0;
+}
+
+// Writes rows of x elements of n bytes each. The header declares the image
+// of the given width, bit depth and color type, the palette of palette_len
+// RGB entries is written for the color type 3.
+static unsigned char *stbiw__write_png_mem(const unsigned char *pixels,
+                                           int stride_bytes, int x, int y,
+                                           int n, int width, int depth,
+                                           int ctype,
+                                           const unsigned char *palette,
+                                           int palette_len, int *out_len) {
   int force_filter = stbi_write_force_png_filter;
-  int ctype[5] = {-1, 0, 4, 2, 6};
+  int plte = palette_len > 0 ? 12 + 3 * palette_len : 0;
   unsigned char sig[8] = {137, 80, 78, 71, 13, 10, 26, 10};
   unsigned char *out, *o, *filt, *zlib;
   signed char *line_buffer;
@@ -1267,6 +1286,18 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels,
       filter_type = force_filter;
       stbiw__encode_png_line((unsigned char *)(pixels), stride_bytes, x, y, j,
                              n, force_filter, line_buffer);
+    } else if (j > 0 && stbiw__png_row_repeats(pixels, stride_bytes, x, y, j,
+                                               n)) {
+      // A repeated row is all zeros with the up filter and no filter can
+      // estimate lower. Only an all zero row keeps the first filter (none).
+      const unsigned char *z =
+          pixels +
+          stride_bytes * (stbi__flip_vertically_on_write ? y - 1 - j : j);
+      filter_type =
+          (z[0] == 0 && (x * n == 1 || memcmp(z, z + 1, x * n - 1) == 0))
+              ? 0
+              : 2;
+      memset(line_buffer, 0, x * n);
     } else {  // Estimate the best filter by running through all of them:
       int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
       for (filter_type = 0; filter_type < 5; filter_type++) {
@@ -1303,24 +1334,32 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels,
   if (!zlib) return 0;
 
   // each tag requires 12 bytes of overhead
-  out = (unsigned char *)STBIW_MALLOC(8 + 12 + 13 + 12 + zlen + 12);
+  out = (unsigned char *)STBIW_MALLOC(8 + 12 + 13 + plte + 12 + zlen + 12);
   if (!out) return 0;
-  *out_len = 8 + 12 + 13 + 12 + zlen + 12;
+  *out_len = 8 + 12 + 13 + plte + 12 + zlen + 12;
 
   o = out;
   STBIW_MEMMOVE(o, sig, 8);
   o += 8;
   stbiw__wp32(o, 13);  // header length
   stbiw__wptag(o, "IHDR");
-  stbiw__wp32(o, x);
+  stbiw__wp32(o, width);
   stbiw__wp32(o, y);
-  *o++ = 8;
-  *o++ = STBIW_UCHAR(ctype[n]);
+  *o++ = STBIW_UCHAR(depth);
+  *o++ = STBIW_UCHAR(ctype);
   *o++ = 0;
   *o++ = 0;
   *o++ = 0;
   stbiw__wpcrc(&o, 13);
 
+  if (palette_len > 0) {
+    stbiw__wp32(o, 3 * palette_len);
+    stbiw__wptag(o, "PLTE");
+    STBIW_MEMMOVE(o, palette, 3 * palette_len);
+    o += 3 * palette_len;
+    stbiw__wpcrc(&o, 3 * palette_len);
+  }
+
   stbiw__wp32(o, zlen);
   stbiw__wptag(o, "IDAT");
   STBIW_MEMMOVE(o, zlib, zlen);
@@ -1337,6 +1376,26 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels,
   return out;
 }
 
+STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels,
+                                              int stride_bytes, int x, int y,
+                                              int n, int *out_len) {
+  int ctype[5] = {-1, 0, 4, 2, 6};
+  return stbiw__write_png_mem(pixels, stride_bytes, x, y, n, x, 8, ctype[n],
+                              NULL, 0, out_len);
+}
+
+// Writes 1, 2 or 4 bit rows packed from the most significant bit. The image
+// is greyscale without the palette, otherwise its pixels index palette_len
+// RGB entries.
+STBIWDEF unsigned char *stbi_write_png_packed_to_mem(
+    const unsigned char *rows, int stride_bytes, int x, int y, int depth,
+    const unsigned char *palette, int palette_len, int *out_len) {
+  int row_bytes = (x * depth + 7) / 8;
+  return stbiw__write_png_mem(rows, stride_bytes, row_bytes, y, 1, x, depth,
+                              palette_len > 0 ? 3 : 0, palette, palette_len,
+                              out_len);
+}
+
 #ifndef STBI_WRITE_NO_STDIO
 STBIWDEF int stbi_write_png(char const *filename, int x, int y, int comp,
                             const void *data, int stride_bytes) {
@@ -25,29 +25,76 @@ the purposes of running distance transform algorithm in current project.
 #define __DT
 
 #define HIGH_CONSTANT 1e9
+// columns transposed together, so the column pass reads whole cache lines
+#define DT_BLOCK 16
 
 #include <assert.h>
 
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <vector>
 
+/// <summary>
+/// Loop over the lines used when the caller passes no parallel one. A
+/// parallel loop has the same signature and runs body(from, to) on chunks
+/// of [begin, end) at least grain long.
+/// </summary>
+struct DTSerialFor {
+  template <typename F>
+  void operator()(int begin, int end, const F& body, int = 1) const {
+    if (begin < end) body(begin, end);
+  }
+};
+
+/// <summary>
+/// Scratch buffers of the distance transform, one set per thread is reused
+/// by all the calls.
+/// </summary>
+struct DTScratch {
+  std::vector<float> d, z, tile;
+  std::vector<int> v;
+};
+
+/// <summary>
+/// Scratch buffers of the calling thread for lines of length n.
+/// </summary>
+/// <param name="n">Line length</param>
+/// <returns>Scratch buffers</returns>
+static inline DTScratch& dtScratch(int n) {
+  static thread_local DTScratch s;
+  if ((int)s.v.size() < n) {
+    s.d.resize(n);
+    s.v.resize(n);
+    s.z.resize((size_t)n + 1);
+    s.tile.resize((size_t)n * DT_BLOCK);
+  }
+  return s;
+}
+
 /// <summary>
 /// DT transform of 1D array
 /// Originated from https://cs.brown.edu/people/pfelzens/dt/index.html
 /// </summary>
 /// <param name="f"> function to compute DT from</param>
+/// <param name="d"> output distances</param>
 /// <param name="n"> length</param>
-/// <returns></returns>
-static float* dt1D(float* f, int n) {
-  float* d = new float[n];
-  int* v = new int[n];
-  float* z = new float[(size_t)n + 1];
+/// <param name="v"> scratch of n locations of the parabolas</param>
+/// <param name="z"> scratch of n + 1 boundaries of the parabolas</param>
+static inline void dt1D(const float* f, float* d, int n, int* v, float* z) {
+  // parabolas of the background never reach the lower envelope
+  int first = 0;
+  while (first < n && f[first] >= HIGH_CONSTANT) first++;
+  if (first == n) {
+    std::fill(d, d + n, (float)HIGH_CONSTANT);
+    return;
+  }
   int k = 0;
-  v[0] = 0;
+  v[0] = first;
   z[0] = -HIGH_CONSTANT;
   z[1] = +HIGH_CONSTANT;
-  for (int q = 1; q <= n - 1; q++) {
+  for (int q = first + 1; q <= n - 1; q++) {
+    if (f[q] >= HIGH_CONSTANT) continue;
     float s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
     while (s <= z[k]) {
       k--;
@@ -64,74 +111,115 @@ static float* dt1D(float* f, int n) {
     while (z[k + 1] < q) k++;
     d[q] = (q - v[k]) * (q - v[k]) + f[v[k]];
   }
-
-  delete[] v;
-  delete[] z;
-  return d;
 }
 
 /// <summary>
-/// DT of 2D function
-/// Originated from https://cs.brown.edu/people/pfelzens/dt/index.html
+/// DT along the columns [from, to). Blocks of DT_BLOCK columns are
+/// transposed to a tile, so both the image and the tile are read by lines.
 /// </summary>
-/// <param name="im"></param>
+/// <param name="src">Input image</param>
+/// <param name="dst">Output squared distances, may be src</param>
 /// <param name="width"></param>
 /// <param name="height"></param>
-static void dt2D(float* im, int width, int height) {
-  float* f = new float[std::max(width, height)];
-
-  // transform along columns
-  for (int x = 0; x < width; x++) {
+/// <param name="from">First column</param>
+/// <param name="to">Column after the last one</param>
+/// <param name="classify">Input is the image of dt(), otherwise a
+/// function</param>
+/// <param name="background">Value of the background pixels of dt()</param>
+template <typename T>
+static void dtColumns(const T* src, float* dst, int width, int height,
+                      int from, int to, bool classify, T background) {
+  DTScratch& s = dtScratch(height);
+  float* tile = s.tile.data();
+  for (int x0 = from; x0 < to; x0 += DT_BLOCK) {
+    int b = std::min(DT_BLOCK, to - x0);
     for (int y = 0; y < height; y++) {
-      // f[y] = imRef(im, x, y);
-      f[y] = im[x + y * width];
+      const T* line = src + x0 + (size_t)y * width;
+      for (int t = 0; t < b; t++) {
+        tile[t * height + y] =
+            classify ? (line[t] == background ? HIGH_CONSTANT : 0.0f)
+                     : (float)line[t];
+      }
+    }
+    for (int t = 0; t < b; t++) {
+      float* column = tile + t * height;
+      dt1D(column, s.d.data(), height, s.v.data(), s.z.data());
+      std::copy(s.d.begin(), s.d.begin() + height, column);
     }
-    float* d = dt1D(f, height);
     for (int y = 0; y < height; y++) {
-      im[x + y * width] = d[y];
+      float* line = dst + x0 + (size_t)y * width;
+      for (int t = 0; t < b; t++) line[t] = tile[t * height + y];
     }
-    delete[] d;
   }
+}
 
-  // transform along rows
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      f[x] = im[x + y * width];
-    }
-    float* d = dt1D(f, width);
+/// <summary>
+/// DT along the rows [from, to) in place.
+/// </summary>
+/// <param name="im">Squared distances of the column pass</param>
+/// <param name="width"></param>
+/// <param name="from">First row</param>
+/// <param name="to">Row after the last one</param>
+/// <param name="root">Output distances instead of the squared ones</param>
+static inline void dtRows(float* im, int width, int from, int to, bool root) {
+  DTScratch& s = dtScratch(width);
+  for (int y = from; y < to; y++) {
+    float* line = im + (size_t)y * width;
+    dt1D(line, s.d.data(), width, s.v.data(), s.z.data());
     for (int x = 0; x < width; x++) {
-      im[x + y * width] = d[x];
+      line[x] = root ? std::sqrt(s.d[x]) : s.d[x];
     }
-    delete[] d;
   }
+}
 
-  delete[] f;
+/// <summary>
+/// Runs both passes of the DT, the lines of each pass by the given loop.
+/// </summary>
+/// <param name="src">Input image</param>
+/// <param name="dst">Output image, may be src</param>
+/// <param name="width"></param>
+/// <param name="height"></param>
+/// <param name="classify">Input is the image of dt(), otherwise a
+/// function</param>
+/// <param name="background">Value of the background pixels of dt()</param>
+/// <param name="root">Output distances instead of the squared ones</param>
+/// <param name="parallelFor">Loop over the lines</param>
+template <typename T, typename ParallelFor>
+static void dtPasses(const T* src, float* dst, int width, int height,
+                     bool classify, T background, bool root,
+                     const ParallelFor& parallelFor) {
+  if (width <= 0 || height <= 0) return;
+  int blocks = (width + DT_BLOCK - 1) / DT_BLOCK;
+  parallelFor(
+      0, blocks,
+      [&](int from, int to) {
+        dtColumns(src, dst, width, height, from * DT_BLOCK,
+                  std::min(to * DT_BLOCK, width), classify, background);
+      },
+      1);
+  parallelFor(
+      0, height, [&](int from, int to) { dtRows(dst, width, from, to, root); },
+      DT_BLOCK);
 }
 
 /// <summary>
-/// DT of an image. Initial function
-/// Originated from https://cs.brown.edu/people/pfelzens/dt/index.html
+/// DT of a labelled image. Pixels with the background label are the
+/// function, the others are the sites.
 /// </summary>
-/// <param name="im"> image data</param>
+/// <param name="labels"> pixel labels</param>
 /// <param name="width"></param>
 /// <param name="height"></param>
+/// <param name="background"> label of the background</param>
+/// <param name="parallelFor"> loop over the lines, e.g. a parallel one of
+/// the caller</param>
 /// <returns></returns>
-static float* dt(float* im, int width, int height) {
+template <typename ParallelFor = DTSerialFor>
+static float* dt(const unsigned char* labels, int width, int height,
+                 unsigned char background,
+                 const ParallelFor& parallelFor = ParallelFor()) {
   float* out = new float[(size_t)width * (size_t)height];
   assert(out != nullptr);
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      // 0.5f have the pixelas that represent background
-      if (im[x + y * width] == 0.5f)
-        out[x + y * width] = HIGH_CONSTANT;
-      else
-        out[x + y * width] = 0;
-    }
-  }
-
-  dt2D(out, width, height);
-  for (int i = 0; i < width * height; i++) out[i] = std::sqrt(out[i]);
-
+  dtPasses(labels, out, width, height, true, background, true, parallelFor);
   return out;
 }
 
@@ -1452,6 +1452,62 @@ int zip_entry_fwrite(struct zip_t *zip, const char *filename) {
   return err;
 }
 
+int zip_entry_compress(const void *buf, size_t bufsize, int level,
+                       void **outbuf, size_t *outbufsize, unsigned int *uncomp_crc32) {
+  mz_uint comp_flags;
+
+  if (!outbuf || !outbufsize || !uncomp_crc32 || (bufsize && !buf)) {
+    return ZIP_ENOINIT;
+  }
+  if (level < 0 || level > MZ_UBER_COMPRESSION) {
+    return ZIP_EINVLVL;
+  }
+
+  // raw deflate stream, the zip local header carries the rest
+  comp_flags = tdefl_create_comp_flags_from_zip_params(
+      level, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+  *uncomp_crc32 = (unsigned int)mz_crc32(MZ_CRC32_INIT,
+                                         (const mz_uint8 *)buf, bufsize);
+  *outbufsize = 0;
+  *outbuf = tdefl_compress_mem_to_heap(buf, bufsize, outbufsize, comp_flags);
+  if (!*outbuf) {
+    return ZIP_ETDEFLBUF;
+  }
+
+  return 0;
+}
+
+int zip_entry_write_compressed(struct zip_t *zip, const char *entryname,
+                               const void *buf, size_t bufsize,
+                               size_t uncomp_size, unsigned int uncomp_crc32) {
+  mz_uint level;
+
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
+  }
+  if (!entryname || strlen(entryname) == 0) {
+    return ZIP_EINVENTNAME;
+  }
+  if (zip->entry.name) {
+    // another entry is being written
+    return ZIP_EINVMODE;
+  }
+
+  // the data are deflated, the method must not fall back to stored
+  level = zip->level & 0xF;
+  if (!level) {
+    level = MZ_DEFAULT_LEVEL;
+  }
+  if (!mz_zip_writer_add_mem_ex(&(zip->archive), entryname, buf, bufsize, NULL,
+                                0, level | MZ_ZIP_FLAG_COMPRESSED_DATA,
+                                uncomp_size, (mz_uint32)uncomp_crc32)) {
+    return ZIP_EWRTENT;
+  }
+
+  return 0;
+}
+
 ssize_t zip_entry_read(struct zip_t *zip, void **buf, size_t *bufsize) {
   mz_zip_archive *pzip = NULL;
   mz_uint idx;
@@ -306,6 +306,45 @@ extern ZIP_EXPORT int zip_entry_write(struct zip_t *zip, const void *buf,
  */
 extern ZIP_EXPORT int zip_entry_fwrite(struct zip_t *zip, const char *filename);
 
+/**
+ * Compresses a memory buffer to a raw deflate stream outside of any archive.
+ * The result can be stored later with zip_entry_write_compressed, so several
+ * entries can be compressed concurrently.
+ *
+ * @param buf input buffer.
+ * @param bufsize input buffer size (in bytes).
+ * @param level compression level (0-9).
+ * @param outbuf output buffer, must be released with free().
+ * @param outbufsize output buffer size (in bytes).
+ * @param uncomp_crc32 CRC-32 checksum of the input buffer.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_entry_compress(const void *buf, size_t bufsize,
+                                         int level, void **outbuf,
+                                         size_t *outbufsize,
+                                         unsigned int *uncomp_crc32);
+
+/**
+ * Adds a new entry whose content was already deflated by zip_entry_compress.
+ * No entry may be opened at the time of the call.
+ *
+ * @param zip zip archive handler.
+ * @param entryname an entry name in local dictionary.
+ * @param buf deflated data.
+ * @param bufsize deflated data size (in bytes).
+ * @param uncomp_size size of the original data (in bytes).
+ * @param uncomp_crc32 CRC-32 checksum of the original data.
+ *
+ * @return the return code - 0 on success, negative number (< 0) on error.
+ */
+extern ZIP_EXPORT int zip_entry_write_compressed(struct zip_t *zip,
+                                                 const char *entryname,
+                                                 const void *buf,
+                                                 size_t bufsize,
+                                                 size_t uncomp_size,
+                                                 unsigned int uncomp_crc32);
+
 /**
  * Extracts the current zip entry into output buffer.
  *
@@ -67,11 +67,45 @@ MU_TEST(test_fwrite) {
   zip_close(zip);
 }
 
+MU_TEST(test_write_compressed) {
+  void *comp = NULL;
+  size_t compsize = 0;
+  unsigned int crc = 0;
+  void *buf = NULL;
+  size_t bufsize = 0;
+  struct zip_t *zip = NULL;
+
+  mu_assert_int_eq(0, zip_entry_compress(TESTDATA1, strlen(TESTDATA1),
+                                         ZIP_DEFAULT_COMPRESSION_LEVEL, &comp,
+                                         &compsize, &crc));
+  mu_check(CRC32DATA1 == crc);
+
+  zip = zip_open(ZIPNAME, ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_entry_write_compressed(zip, "test/test-2.txt", comp,
+                                                 compsize, strlen(TESTDATA1),
+                                                 crc));
+  zip_close(zip);
+  free(comp);
+
+  zip = zip_open(ZIPNAME, 0, 'r');
+  mu_check(zip != NULL);
+  mu_assert_int_eq(0, zip_entry_open(zip, "test/test-2.txt"));
+  mu_assert_int_eq(strlen(TESTDATA1), zip_entry_size(zip));
+  mu_check(CRC32DATA1 == zip_entry_crc32(zip));
+  mu_assert_int_eq(strlen(TESTDATA1), zip_entry_read(zip, &buf, &bufsize));
+  mu_assert_int_eq(0, strncmp(buf, TESTDATA1, bufsize));
+  mu_assert_int_eq(0, zip_entry_close(zip));
+  zip_close(zip);
+  free(buf);
+}
+
 MU_TEST_SUITE(test_write_suite) {
   MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
 
   MU_RUN_TEST(test_write);
   MU_RUN_TEST(test_fwrite);
+  MU_RUN_TEST(test_write_compressed);
 }
 
 #define UNUSED(x) (void)x
@@ -41,6 +41,8 @@
 #include "AllegroOperations.h"
 #define ALLEGRO_UNSTABLE
 
+#include "ColorKernels.h"
+#include "ImageCache.h"
 #include "Utils.h"
 
 void put_pixel(int x, int y, ALLEGRO_BITMAP*& bitmap, const RGB& color) {
@@ -148,7 +150,7 @@ See the stbi library reference at https://www.cs.unh.edu/~cs770/lwjgl-javadoc/lw
   }
 
   // read the image
-  Image<float> img = imread<float>(FOLDER + filename);
+  Image<float> img = *ImageCache::source(FOLDER + filename);
   if (img.width() == 0 || img.height() == 0) {
     std::cout << "ERROR: Image not loaded.\n\
 For supported formats see the stbi library reference at https://www.cs.unh.edu/~cs770/lwjgl-javadoc/lwjgl-stb/org/lwjgl/stb/STBImage.html";
@@ -160,7 +162,6 @@ For supported formats see the stbi library reference at https://www.cs.unh.edu/~
   // install and loar resources
   al_install_keyboard();
   al_install_mouse();
-  Utils::scaleAndPad(img);
   display = al_create_display(img.width(), img.height());
   if (!display) {
     std::cout << "ERROR: Display not created!" << std::endl;
@@ -233,73 +234,182 @@ BYTE* cloneImage(ALLEGRO_BITMAP* bitmap) {
   return image;
 }
 
+/// <summary>
+/// Count of the dirty rectangles above which they are merged to one.
+/// </summary>
+static const size_t DIRTY_MAX_RECTS = 32;
+
+void DirtyRects::add(int x0, int y0, int x1, int y1) {
+  if (all || x0 >= x1 || y0 >= y1) return;
+  Rect r = {x0, y0, x1, y1};
+  // the merged rectangle may touch another one
+  for (size_t i = 0; i < rects.size();) {
+    const Rect& o = rects[i];
+    if (o.x0 <= r.x1 && r.x0 <= o.x1 && o.y0 <= r.y1 && r.y0 <= o.y1) {
+      r = {std::min(r.x0, o.x0), std::min(r.y0, o.y0), std::max(r.x1, o.x1),
+           std::max(r.y1, o.y1)};
+      rects.erase(rects.begin() + i);
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+  rects.push_back(r);
+  if (rects.size() > DIRTY_MAX_RECTS) {
+    for (const Rect& o : rects) {
+      r = {std::min(r.x0, o.x0), std::min(r.y0, o.y0), std::max(r.x1, o.x1),
+           std::max(r.y1, o.y1)};
+    }
+    rects.assign(1, r);
+  }
+}
+
+/// <summary>
+/// Color of the pixel with the scribbles and the merge blocking drawn over
+/// the segments.
+/// </summary>
+/// <param name="intensity"></param>
+/// <param name="c_map"></param>
+/// <param name="scribbleData"></param>
+/// <param name="block"></param>
+/// <param name="flag"> display settings with overlap</param>
+/// <param name="w"></param>
+/// <param name="h"></param>
+/// <returns>Pixel color</returns>
+static RGB overlapColor(const Image<float>& intensity, const ColorMap& c_map,
+                        const short* scribbleData, const BYTE* block,
+                        BYTE flag, int w, int h) {
+  float mul = intensity(w, h);         // intensity in pixel
+  RGB col = c_map.getColorAt(w, h);    // color of segment
+  // case when scribble is at the pixel location
+  if (flag == 1 && scribbleData[w + h * intensity.width()] >= 0) {
+    if (scribbleData[w + h * intensity.width()] == c_map.getMaskAt(w, h))
+      mul /= 2;
+    col = c_map.getColors()[scribbleData[w + h * intensity.width()]];
+    if (col == RGB(1, 1, 1)) {
+      vec2<int> dirs[4] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+      mul = 1;
+      for (int i = 0; i < ALL; i++) {
+        vec2<int> coord = dirs[i] + vec2<int>(w, h);
+        if (coord.x < 0 || coord.y < 0 || coord.x >= c_map.getWidth() ||
+            coord.y >= c_map.getHeight())
+          continue;
+        if (scribbleData[coord.x + coord.y * intensity.width()] !=
+            scribbleData[w + h * intensity.width()]) {
+          col = RGB(0, 0, 0);
+        }
+      }
+    }
+  }
+  if (flag == 3) {
+    col = RGB(1, 1, 1);
+    if (scribbleData[w + h * intensity.width()] != -1) {
+      col = c_map.getColors()[scribbleData[w + h * intensity.width()]];
+      mul = 1;
+
+      vec2<int> dirs[4] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+      for (int i = 0; i < ALL; i++) {
+        vec2<int> coord = dirs[i] + vec2<int>(w, h);
+        if (coord.x < 0 || coord.y < 0 || coord.x >= c_map.getWidth() ||
+            coord.y >= c_map.getHeight())
+          continue;
+        if (scribbleData[coord.x + coord.y * intensity.width()] !=
+            scribbleData[w + h * intensity.width()]) {
+          col = (col.r + col.g + col.b) / 3.0f < 0.5f ? RGB(1, 1, 1)
+                                                      : RGB(0, 0, 0);
+          break;
+        }
+      }
+    }
+  }
+  // draw blocked area
+  if (block[w + h * intensity.width()] == 1) {
+    col = {col.r * 0.7f, col.g * 0.2f, col.b * 0.2f};
+  }
+  if (block[w + h * intensity.width()] == 2) {
+    col = {col.r * 0.2f, col.g * 0.7f, col.b * 0.2f};
+  }
+  return mul * col;
+}
+
+/// <summary>
+/// Composites the columns [x0, x1) of the row. The segments are tinted by
+/// the intensity at once, the pixels with an overlap are drawn one by one.
+/// The channels saturate, a blurred intensity may overshoot [0, 1].
+/// </summary>
+/// <param name="intensity"></param>
+/// <param name="c_map"></param>
+/// <param name="scribbleData"></param>
+/// <param name="block"></param>
+/// <param name="flag"> display settings</param>
+/// <param name="palette"> colors of the unlabelled pixels and segments</param>
+/// <param name="ones"> unit intensities of the row</param>
+/// <param name="h"> row</param>
+/// <param name="x0"> first column</param>
+/// <param name="x1"> column after the last one</param>
+/// <param name="out"> output pixels of the columns</param>
+static void compositeRow(const Image<float>& intensity, const ColorMap& c_map,
+                         const short* scribbleData, const BYTE* block,
+                         BYTE flag, const std::vector<RGB>& palette,
+                         const float* ones, int h, int x0, int x1,
+                         RGBA8* out) {
+  size_t row = (size_t)h * intensity.width();
+  const float* mul = flag != 2 ? intensity.data() + row + x0 : ones;
+  ColorKernels::tint(mul, c_map.data() + row + x0, palette.data(), out,
+                     x1 - x0);
+  if ((flag & 1) == 0) return;
+  for (int w = x0; w < x1; w++) {
+    short scribble = scribbleData[row + w];
+    bool drawn = flag == 1 ? scribble >= 0 : scribble != -1;
+    if (!drawn && block[row + w] == 0) continue;
+    RGB color =
+        overlapColor(intensity, c_map, scribbleData, block, flag, w, h);
+    unsigned char bytes[3];
+    ColorKernels::quantize(&color.r, bytes, 3);
+    RGBA8& px = out[w - x0];
+    px.r = bytes[0];
+    px.g = bytes[1];
+    px.b = bytes[2];
+  }
+}
+
 void set_screen(Image<float>& intensity, const ColorMap& c_map,
                 ALLEGRO_BITMAP*& screen, short* scribbleData, BYTE* block,
-                BYTE flag) {
+                BYTE flag, DirtyRects& dirty) {
   al_set_target_bitmap(screen);
-  al_lock_bitmap(screen, al_get_bitmap_format(screen), ALLEGRO_LOCK_READWRITE);
   al_reset_clipping_rectangle();
-  for (int h = 0; h < intensity.height(); h += 1) {
-    for (int w = 0; w < intensity.width(); w += 1) {
-      float mul = flag != 2 ? intensity(w, h) : 1.0f;  // intensity in pixel
-      RGB col = c_map.getColorAt(w, h);                   // color of segment
-      // -------------------Overlap applied--------------
-      if (flag & 1) {
-        // case when scribble is at the pixel location
-        if (flag == 1 && scribbleData[w + h * intensity.width()] >= 0) {
-          if (scribbleData[w + h * intensity.width()] == c_map.getMaskAt(w, h))
-            mul /= 2;
-          col = c_map.getColors()[scribbleData[w + h * intensity.width()]];
-          if (col == RGB(1, 1, 1)) {
-            vec2<int> dirs[4] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
-            mul = 1;
-            for (int i = 0; i < ALL; i++) {
-              vec2<int> coord = dirs[i] + vec2<int>(w, h);
-              if (coord.x < 0 || coord.y < 0 || coord.x >= c_map.getWidth() ||
-                  coord.y >= c_map.getHeight())
-                continue;
-              if (scribbleData[coord.x + coord.y * intensity.width()] !=
-                  scribbleData[w + h * intensity.width()]) {
-                col = RGB(0, 0, 0);
-              }
-            }
-          }
-        }
-        if (flag == 3) {
-          col = RGB(1, 1, 1);
-          if (scribbleData[w + h * intensity.width()] != -1) {
-            col = c_map.getColors()[scribbleData[w + h * intensity.width()]];
-            mul = 1;
-
-            vec2<int> dirs[4] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
-            for (int i = 0; i < ALL; i++) {
-              vec2<int> coord = dirs[i] + vec2<int>(w, h);
-              if (coord.x < 0 || coord.y < 0 || coord.x >= c_map.getWidth() ||
-                  coord.y >= c_map.getHeight())
-                continue;
-              if (scribbleData[coord.x + coord.y * intensity.width()] !=
-                  scribbleData[w + h * intensity.width()]) {
-                col = (col.r + col.g + col.b) / 3.0f < 0.5f ? RGB(1, 1, 1)
-                                                            : RGB(0, 0, 0);
-                break;
-              }
-            }
-          }
-        }
-        // draw blocked area
-        if (block[w + h * intensity.width()] == 1) {
-          col = {col.r * 0.7f, col.g * 0.2f, col.b * 0.2f};
-        }
-        if (block[w + h * intensity.width()] == 2) {
-          col = {col.r * 0.2f, col.g * 0.7f, col.b * 0.2f};
-        }
-      }
-      // ------------------------------------------------
-      RGB color = mul * col;
-      al_put_pixel(w, h, al_map_rgb_f(color.r, color.g, color.b));
+  int width = intensity.width(), height = intensity.height();
+  if (dirty.all) dirty.rects.assign(1, {0, 0, width, height});
+
+  // segment colors, with the overlap of the scribbles only the intensity is
+  // shown under them
+  std::vector<RGB> palette(1, RGB(DEFAULT_COLOR));
+  if (flag == 3) {
+    palette.resize(c_map.getColors().size() + 1, RGB(1, 1, 1));
+  } else {
+    palette.insert(palette.end(), c_map.getColors().begin(),
+                   c_map.getColors().end());
+  }
+  std::vector<float> ones(width, 1.0f);
+
+  for (const DirtyRects::Rect& r : dirty.rects) {
+    int x0 = std::max(r.x0, 0), y0 = std::max(r.y0, 0);
+    int x1 = std::min(r.x1, width), y1 = std::min(r.y1, height);
+    if (x0 >= x1 || y0 >= y1) continue;
+    // the bytes of the format are in the order of RGBA8
+    ALLEGRO_LOCKED_REGION* region = al_lock_bitmap_region(
+        screen, x0, y0, x1 - x0, y1 - y0, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE,
+        ALLEGRO_LOCK_WRITEONLY);
+    if (region == nullptr) continue;
+    for (int h = y0; h < y1; h++) {
+      RGBA8* out =
+          (RGBA8*)((BYTE*)region->data + (ptrdiff_t)(h - y0) * region->pitch);
+      compositeRow(intensity, c_map, scribbleData, block, flag, palette,
+                   ones.data(), h, x0, x1, out);
     }
+    al_unlock_bitmap(screen);
   }
-  al_unlock_bitmap(screen);
+  dirty.clear();
 }
 
 void circleFill(const unsigned int X, const unsigned int Y,
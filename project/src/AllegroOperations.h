@@ -43,6 +43,7 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "ColorMap.h"
 #include "defines.h"
@@ -119,7 +120,45 @@ void cleanup(ALLEGRO_DISPLAY*& display, ALLEGRO_TIMER*& timer,
 BYTE* cloneImage(ALLEGRO_BITMAP* bitmap);
 
 /// <summary>
-/// Redraws the screen according the intensities and the color map.
+/// Areas of the screen changed since the last composition. Touching
+/// rectangles are merged, the whole screen is dirty at start.
+/// </summary>
+struct DirtyRects {
+  /// <summary>
+  /// Rectangle [x0, x1) x [y0, y1).
+  /// </summary>
+  struct Rect {
+    int x0, y0, x1, y1;
+  };
+
+  std::vector<Rect> rects;
+  bool all = true;
+
+  /// <summary>
+  /// Marks the rectangle [x0, x1) x [y0, y1) dirty.
+  /// </summary>
+  void add(int x0, int y0, int x1, int y1);
+
+  /// <summary>
+  /// Marks the whole screen dirty.
+  /// </summary>
+  void addAll() {
+    all = true;
+    rects.clear();
+  }
+
+  /// <summary>
+  /// Marks the screen clean.
+  /// </summary>
+  void clear() {
+    all = false;
+    rects.clear();
+  }
+};
+
+/// <summary>
+/// Redraws the dirty areas of the screen according the intensities and the
+/// color map. The rows are composited straight to the locked bitmap.
 /// </summary>
 /// <param name="intensity"></param>
 /// <param name="c_map"></param>
@@ -127,9 +166,10 @@ BYTE* cloneImage(ALLEGRO_BITMAP* bitmap);
 /// <param name="scribbleData"> color</param>
 /// <param name="block"> color</param>
 /// <param name="flag"> display settings</param>
+/// <param name="dirty"> areas to redraw, cleared afterwards</param>
 void set_screen(Image<float>& intensity, const ColorMap& c_map,
                 ALLEGRO_BITMAP*& screen, short* scribbleData, BYTE* block,
-                BYTE flag);
+                BYTE flag, DirtyRects& dirty);
 
 /// <summary>
 /// Fills area in the screen with a color in a circle of area depending on its
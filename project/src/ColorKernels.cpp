@@ -0,0 +1,209 @@
+// Copyright (c) 2022 - 2023 Tom Cicvrek, CTU in Prague, FEE
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#define _CRTDBG_MAP_ALLOC
+#include <crtdbg.h>
+#include <stdlib.h>
+#ifdef _DEBUG
+#ifndef DBG_NEW
+#define DBG_NEW new (_NORMAL_BLOCK, __FILE__, __LINE__)
+#define new DBG_NEW
+#endif
+#endif  // _DEBUG
+
+#include "ColorKernels.h"
+
+#include <assert.h>
+#include <immintrin.h>
+
+#include <algorithm>
+
+#include "Utils.h"
+
+static_assert(sizeof(RGB) == 3 * sizeof(float), "RGB is read as floats");
+static_assert(sizeof(RGBA8) == 4, "RGBA8 is written as 32-bit words");
+
+/// <summary>
+/// Channel value quantized to a byte, saturated out of [0, 1].
+/// </summary>
+/// <param name="value">Channel value</param>
+/// <returns>Byte</returns>
+static inline unsigned char toByte(float value) {
+  // NaN ends up as zero, like in the AVX2 kernels
+  return (unsigned char)std::min(255.0f, std::max(0.0f, value * 255.0f));
+}
+
+/// <summary>
+/// Scalar tint of the pixels [from, to).
+/// </summary>
+/// <param name="intensity">Intensity of the pixels</param>
+/// <param name="labels">Labels of the pixels</param>
+/// <param name="palette">Palette starting with the unlabelled colour</param>
+/// <param name="out">Output pixels</param>
+/// <param name="from">First pixel</param>
+/// <param name="to">Pixel after the last one</param>
+static void tintPixels(const float* intensity, const short* labels,
+                       const RGB* palette, RGBA8* out, size_t from,
+                       size_t to) {
+  for (size_t i = from; i < to; i++) {
+    const RGB& col = palette[labels[i] + 1];
+    float mul = intensity[i];
+    out[i].r = toByte(mul * col.r);
+    out[i].g = toByte(mul * col.g);
+    out[i].b = toByte(mul * col.b);
+    out[i].a = 255;
+  }
+}
+
+/// <summary>
+/// Eight channel values quantized to integers in [0, 255].
+/// </summary>
+/// <param name="value">Channel values</param>
+/// <returns>Bytes in 32-bit lanes</returns>
+TARGET_AVX2 static inline __m256i toBytes(__m256 value) {
+  // saturate before the conversion, 256 would carry to the next channel;
+  // the value goes first, so NaN is replaced by zero
+  __m256 v = _mm256_max_ps(_mm256_mul_ps(value, _mm256_set1_ps(255.0f)),
+                           _mm256_setzero_ps());
+  return _mm256_cvttps_epi32(_mm256_min_ps(v, _mm256_set1_ps(255.0f)));
+}
+
+/// <summary>
+/// One channel of eight tinted pixels quantized to integers.
+/// </summary>
+/// <param name="mul">Intensities</param>
+/// <param name="col">Colour channel</param>
+/// <returns>Channel bytes in 32-bit lanes</returns>
+TARGET_AVX2 static inline __m256i tintChannel(__m256 mul, __m256 col) {
+  return toBytes(_mm256_mul_ps(mul, col));
+}
+
+/// <summary>
+/// AVX2 tint of eight pixels at once, the colours are gathered from the
+/// palette.
+/// </summary>
+/// <param name="intensity">Intensity of the pixels</param>
+/// <param name="labels">Labels of the pixels</param>
+/// <param name="palette">Palette starting with the unlabelled colour</param>
+/// <param name="out">Output pixels</param>
+/// <param name="count">Count of the pixels</param>
+TARGET_AVX2 static void tintAVX2(const float* intensity, const short* labels,
+                                 const RGB* palette, RGBA8* out,
+                                 size_t count) {
+  const float* channels = (const float*)palette;
+  const __m256i one = _mm256_set1_epi32(1), three = _mm256_set1_epi32(3);
+  const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i idx = _mm256_cvtepi16_epi32(
+        _mm_loadu_si128((const __m128i*)(labels + i)));
+    idx = _mm256_mullo_epi32(_mm256_add_epi32(idx, one), three);
+    __m256 mul = _mm256_loadu_ps(intensity + i);
+    __m256 r = _mm256_i32gather_ps(channels, idx, 4);
+    __m256 g = _mm256_i32gather_ps(channels + 1, idx, 4);
+    __m256 b = _mm256_i32gather_ps(channels + 2, idx, 4);
+    __m256i ri = tintChannel(mul, r), gi = tintChannel(mul, g);
+    __m256i bi = tintChannel(mul, b);
+    __m256i px = _mm256_or_si256(
+        _mm256_or_si256(ri, _mm256_slli_epi32(gi, 8)),
+        _mm256_or_si256(_mm256_slli_epi32(bi, 16), alpha));
+    _mm256_storeu_si256((__m256i*)(out + i), px);
+  }
+  tintPixels(intensity, labels, palette, out, i, count);
+}
+
+void ColorKernels::tint(const float* intensity, const short* labels,
+                        const RGB* palette, RGBA8* out, size_t count) {
+  if (Utils::hasAVX2()) {
+    tintAVX2(intensity, labels, palette, out, count);
+  } else {
+    tintPixels(intensity, labels, palette, out, 0, count);
+  }
+}
+
+/// <summary>
+/// AVX2 quantization of 32 values at once, the rest is left to the caller.
+/// </summary>
+/// <param name="in">Channel values</param>
+/// <param name="out">Bytes</param>
+/// <param name="count">Count of the values</param>
+/// <returns>Count of the quantized values</returns>
+TARGET_AVX2 static size_t quantizeAVX2(const float* in, unsigned char* out,
+                                       size_t count) {
+  // packing works within 128-bit lanes, the permutation restores the order
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m256i q[4];
+    for (int k = 0; k < 4; k++) {
+      q[k] = toBytes(_mm256_loadu_ps(in + i + 8 * k));
+    }
+    __m256i lo = _mm256_packs_epi32(q[0], q[1]);
+    __m256i hi = _mm256_packs_epi32(q[2], q[3]);
+    __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(lo, hi),
+                                                order);
+    _mm256_storeu_si256((__m256i*)(out + i), bytes);
+  }
+  return i;
+}
+
+void ColorKernels::quantize(const float* in, unsigned char* out,
+                            size_t count) {
+  size_t i = Utils::hasAVX2() ? quantizeAVX2(in, out, count) : 0;
+  for (; i < count; i++) out[i] = toByte(in[i]);
+}
+
+#ifdef _DEBUG
+void ColorKernels::selfTest() {
+  // a blurred canvas overshoots [0, 1] slightly, the rest are extremes
+  const size_t count = 40;
+  float values[count];
+  for (size_t i = 0; i < count; i++) {
+    values[i] = -0.5f + 2.0f * i / (count - 1);
+  }
+  values[0] = -0.0045f;
+  values[1] = 1.0045f;
+  values[2] = 1e9f;
+  values[3] = -1e9f;
+  short labels[count];
+  for (size_t i = 0; i < count; i++) labels[i] = (i / 2) % 2 ? 0 : -1;
+  const RGB palette[2] = {RGB(1, 1, 1), RGB(1, 0.5f, 0)};
+
+  RGBA8 tinted[count], expected[count];
+  unsigned char bytes[count];
+  tint(values, labels, palette, tinted, count);
+  tintPixels(values, labels, palette, expected, 0, count);
+  quantize(values, bytes, count);
+  for (size_t i = 0; i < count; i++) {
+    float v = std::min(255.0f, std::max(0.0f, values[i] * 255.0f));
+    const RGB& col = palette[labels[i] + 1];
+    assert(tinted[i].r == expected[i].r && tinted[i].g == expected[i].g &&
+           tinted[i].b == expected[i].b && tinted[i].a == 255);
+    assert(tinted[i].r == toByte(values[i] * col.r));
+    assert(bytes[i] == (unsigned char)v);
+  }
+  // overshooting white stays white, undershooting black stays black
+  assert(tinted[1].r == 255 && tinted[1].g == 255 && tinted[1].b == 255);
+  assert(tinted[0].r == 0 && tinted[0].g == 0 && tinted[0].b == 0);
+}
+#endif  // _DEBUG
@@ -0,0 +1,80 @@
+// Copyright (c) 2022 - 2023 Tom Cicvrek, CTU in Prague, FEE
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef COLOR_KERNELS__
+#define COLOR_KERNELS__
+
+#define _CRTDBG_MAP_ALLOC
+#include <crtdbg.h>
+#include <stdlib.h>
+#ifdef _DEBUG
+#ifndef DBG_NEW
+#define DBG_NEW new (_NORMAL_BLOCK, __FILE__, __LINE__)
+#define new DBG_NEW
+#endif
+#endif  // _DEBUG
+
+#include <cstddef>
+
+#include "Image.h"
+#include "defines.h"
+
+/// <summary>
+/// Colour operations over whole arrays of pixels. The AVX2 versions are
+/// selected at runtime and give the same results as the scalar ones.
+/// </summary>
+static class ColorKernels {
+ public:
+  /// <summary>
+  /// Tints the intensities by the colours of the labels and quantizes the
+  /// result to bytes, the channel is intensity * colour * 255 clamped to
+  /// [0, 255] and truncated.
+  /// </summary>
+  /// <param name="intensity">Intensity of the pixels</param>
+  /// <param name="labels">Labels of the pixels, -1 for no label</param>
+  /// <param name="palette">Colour of the unlabelled pixels followed by the
+  /// colours of the labels</param>
+  /// <param name="out">Output pixels with opaque alpha</param>
+  /// <param name="count">Count of the pixels</param>
+  static void tint(const float* intensity, const short* labels,
+                   const RGB* palette, RGBA8* out, size_t count);
+
+  /// <summary>
+  /// Quantizes the channels to bytes, value * 255 clamped to [0, 255] and
+  /// truncated.
+  /// </summary>
+  /// <param name="in">Channel values</param>
+  /// <param name="out">Bytes</param>
+  /// <param name="count">Count of the values</param>
+  static void quantize(const float* in, unsigned char* out, size_t count);
+
+#ifdef _DEBUG
+  /// <summary>
+  /// Checks that the AVX2 and the scalar kernels agree and saturate the
+  /// values out of [0, 1].
+  /// </summary>
+  static void selfTest();
+#endif  // _DEBUG
+};
+
+#endif  // !COLOR_KERNELS__
@@ -96,6 +96,8 @@ void ColorMap::segment2Data(const int x, const int y) {
 
 short* ColorMap::data() { return _data; }
 
+const short* ColorMap::data() const { return _data; }
+
 void ColorMap::reset() {
   for (int i = 0; i < _width * _height; i++) _data[i] = -1;
   std::fill(_colors.begin() + 1, _colors.end(), RGB(0, 0, 0));
@@ -59,6 +59,12 @@ class ColorMap {
   /// <returns>Color mask map</returns>
   short* data();
 
+  /// <summary>
+  /// Retireves the data pointer
+  /// </summary>
+  /// <returns>Color mask map</returns>
+  const short* data() const;
+
   /// <summary>
   /// Gets mask index on specific location
   /// </summary>
@@ -0,0 +1,98 @@
+// Copyright (c) 2022 - 2023 Tom Cicvrek, CTU in Prague, FEE
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#define _CRTDBG_MAP_ALLOC
+#include <crtdbg.h>
+#include <stdlib.h>
+#ifdef _DEBUG
+#ifndef DBG_NEW
+#define DBG_NEW new (_NORMAL_BLOCK, __FILE__, __LINE__)
+#define new DBG_NEW
+#endif
+#endif  // _DEBUG
+
+#include "ImageCache.h"
+
+#include "Utils.h"
+
+std::mutex ImageCache::_mutex;
+std::string ImageCache::_path;
+std::filesystem::file_time_type ImageCache::_time;
+std::shared_ptr<const Image<float>> ImageCache::_source;
+std::shared_ptr<const Image<float>> ImageCache::_corrected;
+BYTE ImageCache::_expL = 0;
+
+void ImageCache::refresh(const std::string& path) {
+  std::error_code error;
+  std::filesystem::file_time_type time =
+      std::filesystem::last_write_time(path, error);
+  if (error) {
+    // unreadable file is not cached, the next call tries it again
+    _path.clear();
+    _source = std::make_shared<const Image<float>>();
+    _corrected = _source;
+    return;
+  }
+  if (_source != nullptr && path == _path && time == _time) return;
+
+  std::shared_ptr<Image<float>> im =
+      std::make_shared<Image<float>>(imread<float>(path));
+  if (im->width() > 0 && im->height() > 0) {
+    Utils::scaleAndPad(*im);
+    _path = path;
+    _time = time;
+  } else {
+    _path.clear();
+  }
+  _source = im;
+  _corrected = nullptr;
+}
+
+std::shared_ptr<const Image<float>> ImageCache::source(
+    const std::string& path) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  refresh(path);
+  return _source;
+}
+
+std::shared_ptr<const Image<float>> ImageCache::corrected(
+    const std::string& path, BYTE expL) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  refresh(path);
+  if (_source->width() == 0) return _source;
+  if (_corrected == nullptr || _expL != expL) {
+    std::shared_ptr<Image<float>> im =
+        std::make_shared<Image<float>>(*_source);
+    Utils::gammaCorrection(*im, expL);
+    _corrected = im;
+    _expL = expL;
+  }
+  return _corrected;
+}
+
+void ImageCache::clear() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _path.clear();
+  _source = nullptr;
+  _corrected = nullptr;
+}
@@ -0,0 +1,89 @@
+// Copyright (c) 2022 - 2023 Tom Cicvrek, CTU in Prague, FEE
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef IMAGE_CACHE__
+#define IMAGE_CACHE__
+
+#define _CRTDBG_MAP_ALLOC
+#include <crtdbg.h>
+#include <stdlib.h>
+#ifdef _DEBUG
+#ifndef DBG_NEW
+#define DBG_NEW new (_NORMAL_BLOCK, __FILE__, __LINE__)
+#define new DBG_NEW
+#endif
+#endif  // _DEBUG
+
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "Image.h"
+#include "defines.h"
+
+/// <summary>
+/// Keeps the source image decoded and normalized for the whole session. The
+/// file is read again only when its path or modification time changes, the
+/// callers share the cached images without copying them.
+/// </summary>
+static class ImageCache {
+ public:
+  /// <summary>
+  /// Source image scaled and padded to the canvas size.
+  /// </summary>
+  /// <param name="path">Image file path</param>
+  /// <returns>Shared image, empty when the file can not be read</returns>
+  static std::shared_ptr<const Image<float>> source(const std::string& path);
+
+  /// <summary>
+  /// Gamma corrected source image.
+  /// </summary>
+  /// <param name="path">Image file path</param>
+  /// <param name="expL">Exponent of the gamma correction</param>
+  /// <returns>Shared image, empty when the file can not be read</returns>
+  static std::shared_ptr<const Image<float>> corrected(const std::string& path,
+                                                       BYTE expL = 3);
+
+  /// <summary>
+  /// Drops the cached images.
+  /// </summary>
+  static void clear();
+
+ private:
+  /// <summary>
+  /// Decodes the file when it differs from the cached one. Expects the
+  /// mutex to be locked.
+  /// </summary>
+  /// <param name="path">Image file path</param>
+  static void refresh(const std::string& path);
+
+  static std::mutex _mutex;
+  static std::string _path;
+  static std::filesystem::file_time_type _time;
+  static std::shared_ptr<const Image<float>> _source;
+  static std::shared_ptr<const Image<float>> _corrected;
+  static BYTE _expL;
+};
+
+#endif  // !IMAGE_CACHE__
@@ -25,6 +25,56 @@
 
 #include <Eigen/Core>
 #include <Eigen/Sparse>
+#include <chrono>
+#include <cmath>
+#include <memory>
+
+#include "Parallel.h"
+
+#define MG_TOLERANCE 0.00001f
+#define MG_MAX_CYCLES 30
+#define MG_SMOOTHING 2
+#define MG_COARSEST 2
+#define MG_COARSEST_SWEEPS 20
+#define MG_PARALLEL_CELLS 65536
+
+// limits of the factorization cache
+#define CACHE_ENTRIES 16
+#define CACHE_CELLS 4000000
+
+/// <summary>
+/// Grid of one multigrid level. Each cell is coupled to its right and lower
+/// neighbour, the coupling to the left and upper one is stored in those.
+/// The diagonal also contains couplings to the known pixels.
+/// </summary>
+struct Matrices::Level {
+  int width = 0, height = 0;
+  std::vector<float> x;     // solution
+  std::vector<float> b;     // right hand side
+  std::vector<float> r;     // residual
+  std::vector<float> e;     // interpolated coarse correction
+  std::vector<float> ae;    // operator applied to the correction
+  std::vector<float> wR;    // coupling to the right neighbour
+  std::vector<float> wD;    // coupling to the lower neighbour
+  std::vector<float> diag;  // diagonal of the operator
+};
+
+/// <summary>
+/// Solver data for one domain. The mask is kept to rule out hash collisions.
+/// The multigrid levels also keep the last solution, which is used as the
+/// initial guess of the next solve.
+/// </summary>
+struct Matrices::Factorization {
+  unsigned long long key = 0;
+  int width = 0, height = 0;
+  std::vector<unsigned char> mask;
+  std::shared_ptr<Eigen::SimplicialCholesky<Eigen::SparseMatrix<double>>>
+      cholesky;
+  std::vector<Matrices::Level> levels;
+};
+
+std::list<Matrices::Factorization> Matrices::cache;
+std::mutex Matrices::cacheMutex;
 
 void Matrices::insertValues(int width, int height, int id, int nw, int nh,
                             int& neighCnt, void* _coefs, void* _b, float* img,
@@ -48,7 +98,7 @@ void Matrices::insertValues(int width, int height, int id, int nw, int nh,
     return;
   }
   // Neighbour is unknown and is marked in the A matrix
-  (*coefs).push_back(Eigen::Triplet<double>(id, ids[nid], 1));
+  if (coefs) (*coefs).push_back(Eigen::Triplet<double>(id, ids[nid], 1));
 }
 
 void Matrices::init(void* _coefs, void* _b, int width, int height, float* img,
@@ -80,30 +130,114 @@ void Matrices::init(void* _coefs, void* _b, int width, int height, float* img,
       insertValues(width, height, id, w, h - 1, diag, coefs, b, img, ids);
       insertValues(width, height, id, w, h + 1, diag, coefs, b, img, ids);
 
-      (*coefs).push_back(Eigen::Triplet<double>(id, id, -diag));
+      if (coefs) (*coefs).push_back(Eigen::Triplet<double>(id, id, -diag));
     }
   }
 }
 
-void Matrices::solve(float* img, int width, int height, int* ids, int n) {
+SolverStats Matrices::solve(float* img, int width, int height, int* ids,
+                            int n, LaplaceSolver solver) {
+  SolverStats stats;
+  if (n == 0) {
+    stats.converged = true;
+    return stats;
+  }
+  if (solver == MULTIGRID) return solveMultigrid(img, width, height);
+  if (solver == PCG) return refine(img, img, width, height);
+
+  auto start = std::chrono::steady_clock::now();
+  solveCholesky(img, width, height, ids, n);
+  stats.converged = true;
+  stats.time = std::chrono::duration<float, std::milli>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+  return stats;
+}
+
+unsigned long long Matrices::domainKey(const float* img, int width,
+                                       int height,
+                                       std::vector<unsigned char>& mask) {
+  // FNV-1a over the dimensions and the pixel classes
+  unsigned long long key = 14695981039346656037ull;
+  const unsigned long long prime = 1099511628211ull;
+  key = (key ^ (unsigned long long)width) * prime;
+  key = (key ^ (unsigned long long)height) * prime;
+  mask.resize(width * height);
+  for (int i = 0; i < width * height; i++) {
+    mask[i] = img[i] == -1.0f ? 0 : (img[i] == 0.5f ? 2 : 1);
+    key = (key ^ mask[i]) * prime;
+  }
+  return key;
+}
+
+bool Matrices::takeCached(unsigned long long key,
+                          const std::vector<unsigned char>& mask, int width,
+                          int height, Factorization& out) {
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  for (std::list<Factorization>::iterator it = cache.begin();
+       it != cache.end(); it++) {
+    if (it->key != key || it->width != width || it->height != height ||
+        it->mask != mask)
+      continue;
+    out = std::move(*it);
+    cache.erase(it);
+    return true;
+  }
+  return false;
+}
+
+void Matrices::storeCached(Factorization& f) {
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  cache.push_front(std::move(f));
+  int entries = 0, cells = 0;
+  for (std::list<Factorization>::iterator it = cache.begin();
+       it != cache.end(); it++) {
+    entries += 1;
+    cells += it->width * it->height;
+    // the most recent entry stays even if it is over the limit
+    if (entries > 1 && (entries > CACHE_ENTRIES || cells > CACHE_CELLS)) {
+      cache.erase(it, cache.end());
+      break;
+    }
+  }
+}
+
+void Matrices::solveCholesky(float* img, int width, int height, int* ids,
+                             int n) {
   // img contains -1, 0, 0.5 and 1
   // 1 and 0 are known, 0.5 unknown
   // -1 is skipped and is excluded from computation
   // ids are already detected and n is determined
 
-  std::vector<Eigen::Triplet<double>> coefs;
+  Factorization f;
+  std::vector<unsigned char> mask;
+  unsigned long long key = domainKey(img, width, height, mask);
   Eigen::VectorXd b;
 
-  // initialize the input data
-  init(&coefs, &b, width, height, img, ids, n);
+  if (takeCached(key, mask, width, height, f) && f.cholesky) {
+    // same domain as before, only the right hand side is new
+    init(nullptr, &b, width, height, img, ids, n);
+  } else {
+    std::vector<Eigen::Triplet<double>> coefs;
+    // initialize the input data
+    init(&coefs, &b, width, height, img, ids, n);
+
+    // prepare matrix
+    Eigen::SparseMatrix<double> A(n, n);
+    A.setFromTriplets(coefs.begin(), coefs.end());
 
-  // prepare matrix
-  Eigen::SparseMatrix<double> A(n, n);
-  A.setFromTriplets(coefs.begin(), coefs.end());
+    // factorize the matrix
+    f.cholesky = std::make_shared<
+        Eigen::SimplicialCholesky<Eigen::SparseMatrix<double>>>(A);
+  }
+  f.key = key;
+  f.width = width;
+  f.height = height;
+  f.mask.swap(mask);
 
   // solve the problem
-  Eigen::SimplicialCholesky<Eigen::SparseMatrix<double>> chol(A);
-  Eigen::VectorXd x = chol.solve(b);
+  Eigen::VectorXd x = f.cholesky->solve(b);
+  storeCached(f);
 
   // Prepare return data
   for (int i = 0, k = 0; i < width * height; i++) {
@@ -113,3 +247,339 @@ void Matrices::solve(float* img, int width, int height, int* ids, int n) {
     }
   }
 }
+
+void Matrices::initLevel(Level& level, const float* img, int width,
+                         int height) {
+  int size = width * height;
+  level.width = width;
+  level.height = height;
+  level.x.assign(size, 0.0f);
+  level.b.assign(size, 0.0f);
+  level.r.assign(size, 0.0f);
+  level.e.assign(size, 0.0f);
+  level.ae.assign(size, 0.0f);
+  level.wR.assign(size, 0.0f);
+  level.wD.assign(size, 0.0f);
+  level.diag.assign(size, 0.0f);
+
+  for (int h = 0; h < height; h++) {
+    for (int w = 0; w < width; w++) {
+      int id = w + h * width;
+      if (img[id] != 0.5f) continue;
+      // same stencil as in the assembled matrix, the skipped (-1) and out of
+      // bounds neighbours do not take part in the equation at all
+      const int nw[4] = {w - 1, w + 1, w, w};
+      const int nh[4] = {h, h, h - 1, h + 1};
+      for (int i = 0; i < 4; i++) {
+        if (nw[i] < 0 || nh[i] < 0 || nw[i] == width || nh[i] == height)
+          continue;
+        if (img[nw[i] + nh[i] * width] != -1.0f) level.diag[id] += 1.0f;
+      }
+      if (w + 1 < width && img[id + 1] == 0.5f) level.wR[id] = 1.0f;
+      if (h + 1 < height && img[id + width] == 0.5f) level.wD[id] = 1.0f;
+    }
+  }
+  setRhs(level, img);
+}
+
+void Matrices::setRhs(Level& level, const float* img) {
+  int width = level.width, height = level.height;
+  for (int h = 0; h < height; h++) {
+    for (int w = 0; w < width; w++) {
+      int id = w + h * width;
+      level.b[id] = 0.0f;
+      if (img[id] != 0.5f) continue;
+      // known neighbours move to the right hand side
+      if (w > 0 && img[id - 1] != -1.0f && img[id - 1] != 0.5f)
+        level.b[id] += img[id - 1];
+      if (w + 1 < width && img[id + 1] != -1.0f && img[id + 1] != 0.5f)
+        level.b[id] += img[id + 1];
+      if (h > 0 && img[id - width] != -1.0f && img[id - width] != 0.5f)
+        level.b[id] += img[id - width];
+      if (h + 1 < height && img[id + width] != -1.0f &&
+          img[id + width] != 0.5f)
+        level.b[id] += img[id + width];
+    }
+  }
+}
+
+void Matrices::coarsen(const Level& fine, Level& coarse) {
+  int width = (fine.width + 1) / 2, height = (fine.height + 1) / 2;
+  int size = width * height;
+  coarse.width = width;
+  coarse.height = height;
+  coarse.x.assign(size, 0.0f);
+  coarse.b.assign(size, 0.0f);
+  coarse.r.assign(size, 0.0f);
+  coarse.e.assign(size, 0.0f);
+  coarse.ae.assign(size, 0.0f);
+  coarse.wR.assign(size, 0.0f);
+  coarse.wD.assign(size, 0.0f);
+  coarse.diag.assign(size, 0.0f);
+
+  for (int h = 0; h < fine.height; h++) {
+    for (int w = 0; w < fine.width; w++) {
+      int id = w + h * fine.width;
+      int cid = w / 2 + (h / 2) * width;
+      // couplings inside the block cancel out with the diagonal
+      coarse.diag[cid] += fine.diag[id];
+      if (w % 2 == 0) coarse.diag[cid] -= 2.0f * fine.wR[id];
+      if (h % 2 == 0) coarse.diag[cid] -= 2.0f * fine.wD[id];
+      // couplings leaving the block are summed
+      if (w % 2 == 1) coarse.wR[cid] += fine.wR[id];
+      if (h % 2 == 1) coarse.wD[cid] += fine.wD[id];
+    }
+  }
+}
+
+void Matrices::smooth(Level& level, int first) {
+  int width = level.width;
+  float* x = level.x.data();
+  const float* b = level.b.data();
+  const float* wR = level.wR.data();
+  const float* wD = level.wD.data();
+  const float* diag = level.diag.data();
+
+  for (int c = 0; c < 2; c++) {
+    int color = (first + c) % 2;
+    // cells of the same color are independent, the rows can be split
+    auto rows = [&](int from, int to) {
+      for (int h = from; h < to; h++) {
+        for (int w = (h + color) % 2; w < width; w += 2) {
+          int id = w + h * width;
+          if (diag[id] <= 0.0f) continue;
+          float sum = b[id];
+          if (w > 0) sum += wR[id - 1] * x[id - 1];
+          if (w + 1 < width) sum += wR[id] * x[id + 1];
+          if (h > 0) sum += wD[id - width] * x[id - width];
+          if (h + 1 < level.height) sum += wD[id] * x[id + width];
+          x[id] = sum / diag[id];
+        }
+      }
+    };
+    if (width * level.height >= MG_PARALLEL_CELLS) {
+      Parallel::ThreadPool::shared().parallelFor(0, level.height, rows, 16);
+    } else {
+      rows(0, level.height);
+    }
+  }
+}
+
+void Matrices::apply(const Level& level, const float* x, float* out) {
+  int width = level.width, height = level.height;
+  for (int h = 0; h < height; h++) {
+    for (int w = 0; w < width; w++) {
+      int id = w + h * width;
+      if (level.diag[id] <= 0.0f) {
+        out[id] = 0.0f;
+        continue;
+      }
+      float sum = level.diag[id] * x[id];
+      if (w > 0) sum -= level.wR[id - 1] * x[id - 1];
+      if (w + 1 < width) sum -= level.wR[id] * x[id + 1];
+      if (h > 0) sum -= level.wD[id - width] * x[id - width];
+      if (h + 1 < height) sum -= level.wD[id] * x[id + width];
+      out[id] = sum;
+    }
+  }
+}
+
+double Matrices::residual(Level& level) {
+  int size = level.width * level.height;
+  apply(level, level.x.data(), level.r.data());
+  double norm = 0.0;
+  for (int i = 0; i < size; i++) {
+    level.r[i] = level.diag[i] <= 0.0f ? 0.0f : level.b[i] - level.r[i];
+    norm += (double)level.r[i] * level.r[i];
+  }
+  return norm;
+}
+
+void Matrices::vCycle(std::vector<Level>& levels, int l) {
+  Level& level = levels[l];
+  // the coarsest level has only few cells and is relaxed until it settles
+  if (l == (int)levels.size() - 1) {
+    for (int i = 0; i < MG_COARSEST_SWEEPS; i++) smooth(level, i % 2);
+    return;
+  }
+  for (int i = 0; i < MG_SMOOTHING; i++) smooth(level, 0);
+  residual(level);
+
+  // restrict the residual as a sum over the 2x2 blocks
+  Level& coarse = levels[l + 1];
+  std::fill(coarse.x.begin(), coarse.x.end(), 0.0f);
+  std::fill(coarse.b.begin(), coarse.b.end(), 0.0f);
+  for (int h = 0; h < level.height; h++) {
+    for (int w = 0; w < level.width; w++) {
+      coarse.b[w / 2 + (h / 2) * coarse.width] += level.r[w + h * level.width];
+    }
+  }
+  vCycle(levels, l + 1);
+
+  // Interpolate the correction back. The piecewise constant interpolation
+  // makes the coarse operator too stiff, so the correction is scaled to
+  // minimize the energy of the error.
+  int size = level.width * level.height;
+  for (int h = 0; h < level.height; h++) {
+    for (int w = 0; w < level.width; w++) {
+      int id = w + h * level.width;
+      level.e[id] = level.diag[id] <= 0.0f
+                        ? 0.0f
+                        : coarse.x[w / 2 + (h / 2) * coarse.width];
+    }
+  }
+  apply(level, level.e.data(), level.ae.data());
+  double er = 0.0, eae = 0.0;
+  for (int i = 0; i < size; i++) {
+    er += (double)level.e[i] * level.r[i];
+    eae += (double)level.e[i] * level.ae[i];
+  }
+  float alpha = eae > 0.0 ? (float)(er / eae) : 1.0f;
+  for (int i = 0; i < size; i++) level.x[i] += alpha * level.e[i];
+
+  for (int i = 0; i < MG_SMOOTHING; i++) smooth(level, 1);
+}
+
+bool Matrices::prepareLevels(Factorization& f, const float* img, int width,
+                             int height) {
+  std::vector<unsigned char> mask;
+  unsigned long long key = domainKey(img, width, height, mask);
+  bool cached = takeCached(key, mask, width, height, f) && !f.levels.empty();
+
+  if (cached) {
+    setRhs(f.levels[0], img);
+  } else {
+    f.levels.resize(1);
+    initLevel(f.levels[0], img, width, height);
+    while (std::max(f.levels.back().width, f.levels.back().height) >
+           MG_COARSEST) {
+      f.levels.emplace_back();
+      coarsen(f.levels[f.levels.size() - 2], f.levels.back());
+    }
+  }
+  f.key = key;
+  f.width = width;
+  f.height = height;
+  f.mask.swap(mask);
+  return cached;
+}
+
+double Matrices::dot(const Level& level, const float* a, const float* b) {
+  double ret = 0.0;
+  for (int i = 0; i < level.width * level.height; i++) {
+    ret += (double)a[i] * b[i];
+  }
+  return ret;
+}
+
+SolverStats Matrices::solveMultigrid(float* img, int width, int height) {
+  auto start = std::chrono::steady_clock::now();
+  SolverStats stats;
+  // A cached hierarchy keeps the previous solution as the initial guess,
+  // unchanged boundary values then need no cycle.
+  Factorization f;
+  prepareLevels(f, img, width, height);
+
+  Level& fine = f.levels[0];
+  double bNorm = 0.0;
+  for (float v : fine.b) bNorm += (double)v * v;
+  double tol = (double)MG_TOLERANCE * MG_TOLERANCE * bNorm;
+  if (bNorm == 0.0) std::fill(fine.x.begin(), fine.x.end(), 0.0f);
+
+  double rNorm = residual(fine);
+  while (rNorm > tol && stats.iterations < MG_MAX_CYCLES) {
+    vCycle(f.levels, 0);
+    stats.iterations += 1;
+    rNorm = residual(fine);
+  }
+  stats.residual = bNorm > 0.0 ? (float)std::sqrt(rNorm / bNorm) : 0.0f;
+  stats.converged = rNorm <= tol;
+
+  // Prepare return data
+  for (int i = 0; i < width * height; i++) {
+    if (f.mask[i] == 2) img[i] = fine.x[i];
+  }
+  storeCached(f);
+  stats.time = std::chrono::duration<float, std::milli>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+  return stats;
+}
+
+SolverStats Matrices::refine(float* x, const float* img, int width,
+                             int height, float tolerance) {
+  auto start = std::chrono::steady_clock::now();
+  SolverStats stats;
+  Factorization f;
+  prepareLevels(f, img, width, height);
+
+  // the finest level serves as the preconditioner input and output
+  Level& fine = f.levels[0];
+  int size = width * height;
+  std::vector<float> b = fine.b;
+  std::vector<float> u(size, 0.0f), r(size, 0.0f), z(size, 0.0f),
+      zOld(size, 0.0f), p(size, 0.0f), ap(size, 0.0f);
+  for (int i = 0; i < size; i++) {
+    if (f.mask[i] == 2) u[i] = x[i];
+  }
+
+  // r = b - Au
+  apply(fine, u.data(), r.data());
+  for (int i = 0; i < size; i++) {
+    r[i] = fine.diag[i] > 0.0f ? b[i] - r[i] : 0.0f;
+  }
+
+  double bNorm = dot(fine, b.data(), b.data());
+  double tol = (double)tolerance * tolerance * bNorm;
+  double rNorm = dot(fine, r.data(), r.data());
+  // preconditioner z = M^-1 r is a single V-cycle from zero
+  auto precondition = [&]() {
+    zOld.swap(z);
+    fine.b = r;
+    std::fill(fine.x.begin(), fine.x.end(), 0.0f);
+    vCycle(f.levels, 0);
+    z = fine.x;
+  };
+
+  if (rNorm > tol) {
+    precondition();
+    p = z;
+    double rz = dot(fine, r.data(), z.data());
+    while (stats.iterations < PCG_MAX_ITERATIONS) {
+      stats.iterations += 1;
+      apply(fine, p.data(), ap.data());
+      double pap = dot(fine, p.data(), ap.data());
+      if (pap <= 0.0) break;
+      float alpha = (float)(rz / pap);
+      for (int i = 0; i < size; i++) {
+        u[i] += alpha * p[i];
+        r[i] -= alpha * ap[i];
+      }
+      rNorm = dot(fine, r.data(), r.data());
+      if (rNorm <= tol) break;
+
+      precondition();
+      // The V-cycle scales its corrections, so it is not a fixed linear
+      // operator. The flexible (Polak-Ribiere) beta keeps the convergence.
+      double rzNew = dot(fine, r.data(), z.data());
+      double rzOld = dot(fine, r.data(), zOld.data());
+      float beta = (float)((rzNew - rzOld) / rz);
+      rz = rzNew;
+      for (int i = 0; i < size; i++) p[i] = z[i] + beta * p[i];
+    }
+  }
+  stats.residual = bNorm > 0.0 ? (float)std::sqrt(rNorm / bNorm) : 0.0f;
+  stats.converged = rNorm <= tol;
+
+  // Prepare return data, the solution is also the next initial guess
+  for (int i = 0; i < size; i++) {
+    if (f.mask[i] == 2) x[i] = u[i];
+  }
+  fine.x = u;
+  fine.b.swap(b);
+  storeCached(f);
+  stats.time = std::chrono::duration<float, std::milli>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+  return stats;
+}
@@ -24,9 +24,33 @@
 #ifndef MATRICE_SOLVE
 #define MATRICE_SOLVE
 
+#include <list>
 #include <map>
+#include <mutex>
 #include <vector>
 
+#define PCG_TOLERANCE 0.0001f
+#define PCG_MAX_ITERATIONS 200
+
+/// <summary>
+/// Backends solving the linear system for image laplace.
+/// </summary>
+enum LaplaceSolver {
+  CHOLESKY = 0,  // sparse Cholesky factorization of the assembled matrix
+  MULTIGRID,     // matrix-free geometric multigrid V-cycles
+  PCG            // conjugate gradients preconditioned by a V-cycle
+};
+
+/// <summary>
+/// Statistics of an iterative solve.
+/// </summary>
+struct SolverStats {
+  int iterations = 0;      // number of performed iterations
+  float residual = 0.0f;   // final residual norm
+  bool converged = false;  // the residual reached the tolerance
+  float time = 0.0f;       // duration in milliseconds
+};
+
 /// <summary>
 /// Class used for solving linear system for image laplace.
 /// </summary>
@@ -43,9 +67,175 @@ static class Matrices {
   /// <param name="height">Image height</param>
   /// <param name="ids">IDs of all unknown pixels</param>
   /// <param name="n">Number of unknown pixels</param>
-  static void solve(float* img, int width, int height, int* ids, int n);
+  /// <param name="solver">Backend used for the computation</param>
+  /// <returns>Statistics of the solve, the direct one always
+  /// converges</returns>
+  static SolverStats solve(float* img, int width, int height, int* ids, int n,
+                           LaplaceSolver solver = MULTIGRID);
+
+  /// <summary>
+  /// Solves the same system as solve with single precision preconditioned
+  /// conjugate gradients, starting from the given estimate. Used on the full
+  /// resolution after the estimate from the scaled down image is scaled up.
+  /// </summary>
+  /// <param name="x">Initial estimate / Output image</param>
+  /// <param name="img">Image with boundary conditions (-1, 0, 0.5, 1)</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  /// <param name="tolerance">Relative residual norm to reach</param>
+  /// <returns>Statistics of the solve</returns>
+  static SolverStats refine(float* x, const float* img, int width, int height,
+                            float tolerance = PCG_TOLERANCE);
 
  private:
+  /// <summary>
+  /// Grid of one multigrid level. Defined in the source file.
+  /// </summary>
+  struct Level;
+
+  /// <summary>
+  /// Solver data depending only on the shape of the domain. Defined in the
+  /// source file.
+  /// </summary>
+  struct Factorization;
+
+  /// <summary>
+  /// Recently used factorizations, the most recent first.
+  /// </summary>
+  static std::list<Factorization> cache;
+  static std::mutex cacheMutex;
+
+  /// <summary>
+  /// Classifies pixels of the domain to skipped, known and unknown ones.
+  /// </summary>
+  /// <param name="img">Image</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  /// <param name="mask">Output classification</param>
+  /// <returns>Hash of the classification</returns>
+  static unsigned long long domainKey(const float* img, int width, int height,
+                                      std::vector<unsigned char>& mask);
+
+  /// <summary>
+  /// Removes the factorization of the domain from the cache, so it can be
+  /// used exclusively.
+  /// </summary>
+  /// <param name="key">Hash of the domain</param>
+  /// <param name="mask">Classification of the domain</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  /// <param name="out">Output factorization</param>
+  /// <returns>Whether the factorization was found</returns>
+  static bool takeCached(unsigned long long key,
+                         const std::vector<unsigned char>& mask, int width,
+                         int height, Factorization& out);
+
+  /// <summary>
+  /// Puts the factorization to the cache and drops the least recently used
+  /// ones over the limit.
+  /// </summary>
+  /// <param name="f">Factorization</param>
+  static void storeCached(Factorization& f);
+
+  /// <summary>
+  /// Takes the multigrid hierarchy of the domain from the cache or builds
+  /// it. The finest level gets the right hand side of the image.
+  /// </summary>
+  /// <param name="f">Output factorization</param>
+  /// <param name="img">Image</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  /// <returns>Whether the hierarchy was cached</returns>
+  static bool prepareLevels(Factorization& f, const float* img, int width,
+                            int height);
+
+  /// <summary>
+  /// Solves the system by factorizing the assembled sparse matrix.
+  /// </summary>
+  /// <param name="img">Input / Output image</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  /// <param name="ids">IDs of all unknown pixels</param>
+  /// <param name="n">Number of unknown pixels</param>
+  static void solveCholesky(float* img, int width, int height, int* ids,
+                            int n);
+
+  /// <summary>
+  /// Solves the system by multigrid V-cycles working directly on the image
+  /// grid. Time and memory are linear in the size of the image. Stops on the
+  /// relative residual MG_TOLERANCE or after MG_MAX_CYCLES cycles.
+  /// </summary>
+  /// <param name="img">Input / Output image</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  /// <returns>Statistics of the solve, iterations are the cycles</returns>
+  static SolverStats solveMultigrid(float* img, int width, int height);
+
+  /// <summary>
+  /// Creates the finest level from the image. Unknown pixels are coupled
+  /// with their unknown neighbours, known neighbours move to the right hand
+  /// side.
+  /// </summary>
+  /// <param name="level">Output level</param>
+  /// <param name="img">Image</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  static void initLevel(Level& level, const float* img, int width,
+                        int height);
+
+  /// <summary>
+  /// Sets right hand side of the finest level from the known pixels.
+  /// </summary>
+  /// <param name="level">Finest level</param>
+  /// <param name="img">Image</param>
+  static void setRhs(Level& level, const float* img);
+
+  /// <summary>
+  /// Creates coarser level by merging 2x2 blocks of cells. The coarse
+  /// operator is the Galerkin product with piecewise constant interpolation.
+  /// </summary>
+  /// <param name="fine">Fine level</param>
+  /// <param name="coarse">Output coarse level</param>
+  static void coarsen(const Level& fine, Level& coarse);
+
+  /// <summary>
+  /// Computes dot product of two vectors over the level.
+  /// </summary>
+  /// <param name="level">Level</param>
+  /// <param name="a">First vector</param>
+  /// <param name="b">Second vector</param>
+  /// <returns>Dot product</returns>
+  static double dot(const Level& level, const float* a, const float* b);
+
+  /// <summary>
+  /// Red-black Gauss-Seidel sweep over the level.
+  /// </summary>
+  /// <param name="level">Level</param>
+  /// <param name="first">Color relaxed first</param>
+  static void smooth(Level& level, int first);
+
+  /// <summary>
+  /// Computes product of the level operator and a vector.
+  /// </summary>
+  /// <param name="level">Level</param>
+  /// <param name="x">Input vector</param>
+  /// <param name="out">Output vector</param>
+  static void apply(const Level& level, const float* x, float* out);
+
+  /// <summary>
+  /// Computes residual of the level.
+  /// </summary>
+  /// <param name="level">Level</param>
+  /// <returns>Squared norm of the residual</returns>
+  static double residual(Level& level);
+
+  /// <summary>
+  /// One V-cycle starting at the given level.
+  /// </summary>
+  /// <param name="levels">Level hierarchy</param>
+  /// <param name="l">Current level</param>
+  static void vCycle(std::vector<Level>& levels, int l);
+
   /// <summary>
   /// Function inserting data to the matrix A and modifying data in the right
   /// hand vector depending on the space and boundary conditions in the image.
@@ -0,0 +1,204 @@
+// Copyright (c) 2022 - 2023 Tom Cicvrek, CTU in Prague, FEE
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#define _CRTDBG_MAP_ALLOC
+#include <crtdbg.h>
+#include <stdlib.h>
+#ifdef _DEBUG
+#ifndef DBG_NEW
+#define DBG_NEW new (_NORMAL_BLOCK, __FILE__, __LINE__)
+#define new DBG_NEW
+#endif
+#endif  // _DEBUG
+
+#include "Morphology.h"
+
+#include <algorithm>
+#include <vector>
+
+/// <summary>
+/// Scratch buffers of the running extremum.
+/// </summary>
+template <typename T>
+struct ExtremeScratch {
+  std::vector<T> p;  // padded line
+  std::vector<T> g;  // block prefixes
+  std::vector<T> h;  // block suffixes
+};
+
+/// <summary>
+/// Running extremum over windows of 2 * radius + 1 elements of a line. An
+/// element is a vector of lanes values, so the columns of an image are
+/// filtered row by row. The line is split to blocks of the window length,
+/// every window is covered by a suffix of one block and a prefix of the next
+/// one.
+/// </summary>
+/// <param name="line">Line data, overwritten by the result</param>
+/// <param name="n">Count of the elements</param>
+/// <param name="lanes">Values per element</param>
+/// <param name="radius">Filter radius</param>
+/// <param name="pad">Neutral value of the operation</param>
+/// <param name="op">Associative operation</param>
+/// <param name="s">Scratch buffers</param>
+template <typename T, typename Op>
+static void runningExtreme(T* line, int n, int lanes, int radius, T pad,
+                           Op op, ExtremeScratch<T>& s) {
+  if (radius <= 0 || n <= 0) return;
+  int k = 2 * radius + 1, len = n + 2 * radius;
+  size_t size = (size_t)len * lanes, margin = (size_t)radius * lanes;
+  s.p.resize(size);
+  s.g.resize(size);
+  s.h.resize(size);
+  T* p = s.p.data();
+  T* g = s.g.data();
+  T* h = s.h.data();
+  // the line is padded by radius neutral elements on both sides
+  std::fill(p, p + margin, pad);
+  std::copy(line, line + (size_t)n * lanes, p + margin);
+  std::fill(p + size - margin, p + size, pad);
+
+  // element-wise combination of two vectors of lanes values
+  auto combine = [&](T* __restrict dst, const T* __restrict a,
+                     const T* __restrict b) {
+    for (int l = 0; l < lanes; l++) dst[l] = op(a[l], b[l]);
+  };
+  for (int b = 0; b < len; b += k) {
+    int e = std::min(b + k, len);
+    std::copy(p + (size_t)b * lanes, p + (size_t)(b + 1) * lanes,
+              g + (size_t)b * lanes);
+    for (int i = b + 1; i < e; i++) {
+      combine(g + (size_t)i * lanes, g + (size_t)(i - 1) * lanes,
+              p + (size_t)i * lanes);
+    }
+    std::copy(p + (size_t)(e - 1) * lanes, p + (size_t)e * lanes,
+              h + (size_t)(e - 1) * lanes);
+    for (int i = e - 2; i >= b; i--) {
+      combine(h + (size_t)i * lanes, h + (size_t)(i + 1) * lanes,
+              p + (size_t)i * lanes);
+    }
+  }
+  const T* gx = g + (size_t)2 * radius * lanes;
+  for (int x = 0; x < n; x++) {
+    combine(line + (size_t)x * lanes, h + (size_t)x * lanes,
+            gx + (size_t)x * lanes);
+  }
+}
+
+// the operation is a function object, so it is inlined in the loops
+struct OrOp {
+  uint64_t operator()(uint64_t a, uint64_t b) const { return a | b; }
+};
+
+void Morphology::pack(const BYTE* src, uint64_t* bits, int width, int height,
+                      BYTE below) {
+  int words = rowWords(width);
+  for (int y = 0; y < height; y++) {
+    const BYTE* row = src + (size_t)y * width;
+    uint64_t* out = bits + (size_t)y * words;
+    for (int w = 0; w < words; w++) {
+      uint64_t word = 0;
+      int end = std::min(64, width - w * 64);
+      for (int b = 0; b < end; b++) {
+        word |= (uint64_t)(row[w * 64 + b] < below) << b;
+      }
+      out[w] = word;
+    }
+  }
+}
+
+void Morphology::unpack(const uint64_t* bits, BYTE* dst, int width,
+                        int height, BYTE on, BYTE off) {
+  int words = rowWords(width);
+  for (int y = 0; y < height; y++) {
+    const uint64_t* row = bits + (size_t)y * words;
+    BYTE* out = dst + (size_t)y * width;
+    for (int x = 0; x < width; x++) {
+      out[x] = (row[x >> 6] >> (x & 63)) & 1 ? on : off;
+    }
+  }
+}
+
+/// <summary>
+/// ORs the row shifted by s pixels to the row, s > 0 moves the pixels to the
+/// higher x.
+/// </summary>
+/// <param name="row">Bit packed row</param>
+/// <param name="tmp">Scratch of the row length</param>
+/// <param name="words">Words of the row</param>
+/// <param name="s">Shift in pixels</param>
+static void orShifted(uint64_t* row, uint64_t* tmp, int words, int s) {
+  int ws = std::abs(s) / 64, bs = std::abs(s) % 64;
+  for (int w = 0; w < words; w++) {
+    // source words of the pixels shifted to the word w
+    int hi = s > 0 ? w - ws : w + ws;
+    int lo = s > 0 ? hi - 1 : hi + 1;
+    uint64_t a = hi >= 0 && hi < words ? row[hi] : 0;
+    uint64_t b = lo >= 0 && lo < words ? row[lo] : 0;
+    if (bs == 0) {
+      tmp[w] = a;
+    } else if (s > 0) {
+      tmp[w] = (a << bs) | (b >> (64 - bs));
+    } else {
+      tmp[w] = (a >> bs) | (b << (64 - bs));
+    }
+  }
+  for (int w = 0; w < words; w++) row[w] |= tmp[w];
+}
+
+void Morphology::dilateBits(uint64_t* bits, int width, int height,
+                            int radius) {
+  if (radius <= 0 || width <= 0 || height <= 0) return;
+  int words = rowWords(width);
+  uint64_t tail =
+      width % 64 == 0 ? ~(uint64_t)0 : ((uint64_t)1 << (width % 64)) - 1;
+  std::vector<uint64_t> tmp(words);
+  for (int y = 0; y < height; y++) {
+    uint64_t* row = bits + (size_t)y * words;
+    row[words - 1] &= tail;
+    // spread the pixels by doubling shifts, each covers the offsets
+    // [-covered, covered] reached so far
+    for (int covered = 0; covered < radius;) {
+      int s = std::min(covered + 1, radius - covered);
+      orShifted(row, tmp.data(), words, s);
+      orShifted(row, tmp.data(), words, -s);
+      covered += s;
+    }
+    row[words - 1] &= tail;
+  }
+  ExtremeScratch<uint64_t> s;
+  runningExtreme(bits, height, words, radius, (uint64_t)0, OrOp(), s);
+}
+
+void Morphology::erodeBits(uint64_t* bits, int width, int height,
+                           int radius) {
+  // erosion of the mask is the dilation of its complement, the pixels out of
+  // the image stay out of the complement
+  size_t size = (size_t)rowWords(width) * height;
+  for (size_t i = 0; i < size; i++) bits[i] = ~bits[i];
+  dilateBits(bits, width, height, radius);
+  int words = rowWords(width);
+  uint64_t tail =
+      width % 64 == 0 ? ~(uint64_t)0 : ((uint64_t)1 << (width % 64)) - 1;
+  for (size_t i = 0; i < size; i++) bits[i] = ~bits[i];
+  for (int y = 0; y < height; y++) bits[(size_t)y * words + words - 1] &= tail;
+}
@@ -0,0 +1,100 @@
+// Copyright (c) 2022 - 2023 Tom Cicvrek, CTU in Prague, FEE
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef MORPHOLOGY__
+#define MORPHOLOGY__
+
+#define _CRTDBG_MAP_ALLOC
+#include <crtdbg.h>
+#include <stdlib.h>
+#ifdef _DEBUG
+#ifndef DBG_NEW
+#define DBG_NEW new (_NORMAL_BLOCK, __FILE__, __LINE__)
+#define new DBG_NEW
+#endif
+#endif  // _DEBUG
+
+#include <cstdint>
+
+#include "defines.h"
+
+/// <summary>
+/// Separable morphology of bit packed masks. The filters cost a constant
+/// number of operations per pixel regardless of the radius (van Herk /
+/// Gil-Werman), the pixels outside of the image do not change the result.
+/// All filters work in place.
+/// </summary>
+static class Morphology {
+ public:
+  /// <summary>
+  /// Count of 64-bit words of a bit packed row.
+  /// </summary>
+  /// <param name="width">Image width</param>
+  /// <returns>Words per row</returns>
+  static int rowWords(int width) { return (width + 63) / 64; }
+
+  /// <summary>
+  /// Packs the pixels darker than the threshold to bits, pixel x is the bit
+  /// x % 64 of the word x / 64.
+  /// </summary>
+  /// <param name="src">Image data</param>
+  /// <param name="bits">Output of rowWords(width) * height words</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  /// <param name="below">Threshold of the set pixels</param>
+  static void pack(const BYTE* src, uint64_t* bits, int width, int height,
+                   BYTE below);
+
+  /// <summary>
+  /// Unpacks bits to the mask.
+  /// </summary>
+  /// <param name="bits">Bit packed mask</param>
+  /// <param name="dst">Output mask</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  /// <param name="on">Value of the set pixels</param>
+  /// <param name="off">Value of the other pixels</param>
+  static void unpack(const uint64_t* bits, BYTE* dst, int width, int height,
+                     BYTE on = 255, BYTE off = 0);
+
+  /// <summary>
+  /// Dilation of the bit packed mask by a square. Rows are shifted a word at
+  /// a time.
+  /// </summary>
+  /// <param name="bits">Bit packed mask</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  /// <param name="radius">Half of the square side</param>
+  static void dilateBits(uint64_t* bits, int width, int height, int radius);
+
+  /// <summary>
+  /// Erosion of the bit packed mask by a square.
+  /// </summary>
+  /// <param name="bits">Bit packed mask</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  /// <param name="radius">Half of the square side</param>
+  static void erodeBits(uint64_t* bits, int width, int height, int radius);
+};
+
+#endif  // !MORPHOLOGY__
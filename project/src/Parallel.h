@@ -0,0 +1,204 @@
+// Copyright (c) 2022 - 2023 Tom Cicvrek, CTU in Prague, FEE
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PARALLEL__
+#define PARALLEL__
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Parallel {
+
+/// <summary>
+/// Number of hardware threads, at least one.
+/// </summary>
+/// <returns>Thread count</returns>
+inline int threadCount() {
+  unsigned int n = std::thread::hardware_concurrency();
+  return n == 0 ? 1 : (int)n;
+}
+
+/// <summary>
+/// Pool of worker threads shared by the export pipeline and the image
+/// kernels. A thread waiting for its tasks runs the queued ones itself, so
+/// tasks may wait for other tasks without blocking the pool.
+/// </summary>
+class ThreadPool {
+ public:
+  /// <summary>
+  /// Starts the workers.
+  /// </summary>
+  /// <param name="threads">Number of workers</param>
+  explicit ThreadPool(int threads = threadCount()) : _stop(false) {
+    for (int i = 0; i < threads; i++) {
+      _workers.emplace_back([this]() { work(); });
+    }
+  }
+
+  /// <summary>
+  /// Finishes the queued tasks and joins the workers.
+  /// </summary>
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _cv.notify_all();
+    for (std::thread& t : _workers) t.join();
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /// <summary>
+  /// Pool shared by the whole application.
+  /// </summary>
+  /// <returns>Shared pool</returns>
+  static ThreadPool& shared() {
+    static ThreadPool pool;
+    return pool;
+  }
+
+  /// <summary>
+  /// Number of workers.
+  /// </summary>
+  /// <returns>Worker count</returns>
+  int size() const { return (int)_workers.size(); }
+
+  /// <summary>
+  /// Queues a task.
+  /// </summary>
+  /// <param name="f">Task</param>
+  /// <returns>Future holding the task result</returns>
+  template <typename F>
+  auto submit(F f) -> std::future<decltype(f())> {
+    typedef decltype(f()) R;
+    std::shared_ptr<std::packaged_task<R()>> task =
+        std::make_shared<std::packaged_task<R()>>(std::move(f));
+    std::future<R> ret = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _tasks.push_back([task]() { (*task)(); });
+    }
+    _cv.notify_one();
+    return ret;
+  }
+
+  /// <summary>
+  /// Waits for the future while running queued tasks on the calling thread.
+  /// </summary>
+  /// <param name="future">Awaited future</param>
+  template <typename R>
+  void wait(std::future<R>& future) {
+    while (future.wait_for(std::chrono::seconds(0)) !=
+           std::future_status::ready) {
+      // the awaited task was queued earlier, with empty queue it is running
+      if (!runOne()) {
+        future.wait();
+        return;
+      }
+    }
+  }
+
+  /// <summary>
+  /// Splits the range to chunks and runs body(from, to) on them in parallel.
+  /// The calling thread processes one of the chunks.
+  /// </summary>
+  /// <param name="begin">First index</param>
+  /// <param name="end">Index after the last one</param>
+  /// <param name="body">Function processing [from, to)</param>
+  /// <param name="grain">Minimal chunk length</param>
+  template <typename F>
+  void parallelFor(int begin, int end, const F& body, int grain = 1) {
+    int len = end - begin;
+    if (len <= 0) return;
+    int chunks = std::min(std::min(size() + 1, threadCount()),
+                          std::max(1, len / std::max(grain, 1)));
+    if (chunks <= 1) {
+      body(begin, end);
+      return;
+    }
+    std::vector<std::future<void>> futures;
+    futures.reserve(chunks - 1);
+    for (int c = 1; c < chunks; c++) {
+      int from = begin + (int)((long long)len * c / chunks);
+      int to = begin + (int)((long long)len * (c + 1) / chunks);
+      futures.push_back(submit([&body, from, to]() { body(from, to); }));
+    }
+    body(begin, begin + len / chunks);
+    for (std::future<void>& f : futures) wait(f);
+    for (std::future<void>& f : futures) f.get();
+  }
+
+ private:
+  /// <summary>
+  /// Runs one queued task on the calling thread.
+  /// </summary>
+  /// <returns>Whether a task was run</returns>
+  bool runOne() {
+    std::function<void()> task;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_tasks.empty()) return false;
+      task = std::move(_tasks.front());
+      _tasks.pop_front();
+    }
+    task();
+    return true;
+  }
+
+  /// <summary>
+  /// Worker loop.
+  /// </summary>
+  void work() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [this]() { return _stop || !_tasks.empty(); });
+        if (_stop && _tasks.empty()) return;
+        task = std::move(_tasks.front());
+        _tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::vector<std::thread> _workers;
+  std::deque<std::function<void()>> _tasks;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  bool _stop;
+};
+
+}  // namespace Parallel
+
+#endif  // !PARALLEL__
@@ -0,0 +1,127 @@
+// Copyright (c) 2022 - 2023 Tom Cicvrek, CTU in Prague, FEE
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#define _CRTDBG_MAP_ALLOC
+#include <crtdbg.h>
+#include <stdlib.h>
+#ifdef _DEBUG
+#ifndef DBG_NEW
+#define DBG_NEW new (_NORMAL_BLOCK, __FILE__, __LINE__)
+#define new DBG_NEW
+#endif
+#endif  // _DEBUG
+
+#include "ProjectExport.h"
+
+#include <string.h>
+
+#include <iostream>
+
+#include "Parallel.h"
+#include "zip.h"
+
+ProjectExport::ProjectExport() { zip = nullptr; }
+
+ProjectExport::~ProjectExport() { close(); }
+
+bool ProjectExport::open(const std::string& path) {
+  close();
+  zip = zip_open(path.c_str(), ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
+  return zip != nullptr;
+}
+
+void ProjectExport::add(const std::string& name, Producer producer) {
+  if (!zip) return;
+  Entry entry;
+  entry.name = name;
+  entry.data = Parallel::ThreadPool::shared().submit([producer]() {
+    Compressed ret;
+    int len = 0;
+    unsigned char* data = producer(&len);
+    if (data == nullptr || len <= 0) {
+      free(data);
+      return ret;
+    }
+    // deflate here, so the archive only copies the finished stream
+    if (zip_entry_compress(data, len, ZIP_DEFAULT_COMPRESSION_LEVEL, &ret.data,
+                           &ret.size, &ret.crc) == 0) {
+      ret.uncompSize = len;
+      ret.deflated = true;
+      free(data);
+    } else {
+      ret.data = data;
+      ret.size = len;
+    }
+    return ret;
+  });
+  entries.push_back(std::move(entry));
+  // write what is already done to keep the memory bounded
+  flush(false);
+}
+
+void ProjectExport::add(const std::string& name, const std::string& content) {
+  add(name, [content](int* len) {
+    unsigned char* data = (unsigned char*)malloc(content.size());
+    if (data) memcpy(data, content.c_str(), content.size());
+    *len = (int)content.size();
+    return data;
+  });
+}
+
+void ProjectExport::close() {
+  if (!zip) return;
+  flush(true);
+  zip_close(zip);
+  zip = nullptr;
+}
+
+void ProjectExport::flush(bool wait) {
+  while (!entries.empty()) {
+    Entry& entry = entries.front();
+    if (wait) {
+      Parallel::ThreadPool::shared().wait(entry.data);
+    } else if (entry.data.wait_for(std::chrono::seconds(0)) !=
+               std::future_status::ready) {
+      return;
+    }
+    Compressed data = entry.data.get();
+    int err = 0;
+    if (data.deflated) {
+      err = zip_entry_write_compressed(zip, entry.name.c_str(), data.data,
+                                       data.size, data.uncompSize, data.crc);
+    } else {
+      // raw data the deflate failed on, or an empty entry
+      err = zip_entry_open(zip, entry.name.c_str());
+      if (err == 0) {
+        if (data.size > 0) err = zip_entry_write(zip, data.data, data.size);
+        int closed = zip_entry_close(zip);
+        if (err == 0) err = closed;
+      }
+    }
+    if (err < 0)
+      std::cerr << "Error while exporting " << entry.name << ": "
+                << zip_strerror(err) << std::endl;
+    free(data.data);
+    entries.pop_front();
+  }
+}
@@ -0,0 +1,120 @@
+// Copyright (c) 2022 - 2023 Tom Cicvrek, CTU in Prague, FEE
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PROJECT_EXPORT
+#define PROJECT_EXPORT
+
+#define _CRTDBG_MAP_ALLOC
+#include <crtdbg.h>
+#include <stdlib.h>
+#ifdef _DEBUG
+#ifndef DBG_NEW
+#define DBG_NEW new (_NORMAL_BLOCK, __FILE__, __LINE__)
+#define new DBG_NEW
+#endif
+#endif  // _DEBUG
+
+#include <deque>
+#include <functional>
+#include <future>
+#include <string>
+
+struct zip_t;
+
+/// <summary>
+/// Pipelined writer of the Monster Mash project archive. Entry data are
+/// produced (rasterized and PNG encoded) and deflated on worker threads, the
+/// precompressed entries are appended to the archive in the order they were
+/// added.
+/// </summary>
+class ProjectExport {
+ public:
+  /// <summary>
+  /// Producer of the entry data. Returns buffer allocated by malloc and sets
+  /// its length.
+  /// </summary>
+  typedef std::function<unsigned char*(int* len)> Producer;
+
+  ProjectExport();
+
+  ~ProjectExport();
+
+  /// <summary>
+  /// Creates new archive, an existing one is overwritten.
+  /// </summary>
+  /// <param name="path">Archive path</param>
+  /// <returns>Success of the operation</returns>
+  bool open(const std::string& path);
+
+  /// <summary>
+  /// Queues an entry, its data are produced and compressed asynchronously.
+  /// Everything the producer references has to live until close().
+  /// </summary>
+  /// <param name="name">Entry name</param>
+  /// <param name="producer">Producer of the entry data</param>
+  void add(const std::string& name, Producer producer);
+
+  /// <summary>
+  /// Queues an entry containing the given text.
+  /// </summary>
+  /// <param name="name">Entry name</param>
+  /// <param name="content">Entry content</param>
+  void add(const std::string& name, const std::string& content);
+
+  /// <summary>
+  /// Waits for all queued entries, writes them and closes the archive.
+  /// </summary>
+  void close();
+
+ private:
+  /// <summary>
+  /// Entry data deflated on a worker thread. When the deflate fails, the raw
+  /// data are kept and written to the archive as they are.
+  /// </summary>
+  struct Compressed {
+    void* data = nullptr;
+    size_t size = 0;
+    size_t uncompSize = 0;
+    unsigned int crc = 0;
+    bool deflated = false;
+  };
+
+  /// <summary>
+  /// Queued entry.
+  /// </summary>
+  struct Entry {
+    std::string name;
+    std::future<Compressed> data;
+  };
+
+  /// <summary>
+  /// Writes finished entries from the front of the queue.
+  /// </summary>
+  /// <param name="wait">Wait for the unfinished entries as well</param>
+  void flush(bool wait);
+
+  zip_t* zip;
+  std::deque<Entry> entries;
+};
+
+#endif  // !PROJECT_EXPORT
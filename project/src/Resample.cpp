@@ -0,0 +1,273 @@
+// Copyright (c) 2022 - 2023 Tom Cicvrek, CTU in Prague, FEE
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#define _CRTDBG_MAP_ALLOC
+#include <crtdbg.h>
+#include <stdlib.h>
+#ifdef _DEBUG
+#ifndef DBG_NEW
+#define DBG_NEW new (_NORMAL_BLOCK, __FILE__, __LINE__)
+#define new DBG_NEW
+#endif
+#endif  // _DEBUG
+
+#include "Resample.h"
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "Parallel.h"
+#include "Utils.h"
+
+/// <summary>
+/// Weights of the source pixels along one axis. Output pixel i is the sum of
+/// count[i] source pixels starting at first[i] multiplied by the weights
+/// starting at offset[i].
+/// </summary>
+struct ResampleWeights {
+  std::vector<int> first;
+  std::vector<int> count;
+  std::vector<int> offset;
+  std::vector<float> weight;
+};
+
+/// <summary>
+/// Length of the overlap of the source pixel with the interval.
+/// </summary>
+/// <param name="s">Source pixel</param>
+/// <param name="lo">Interval start</param>
+/// <param name="hi">Interval end</param>
+/// <returns>Overlap length</returns>
+static inline double overlap(int s, double lo, double hi) {
+  return std::max(std::min(hi, s + 1.0) - std::max(lo, (double)s), 0.0);
+}
+
+/// <summary>
+/// Computes the weights of the source pixels of all output pixels of the
+/// axis. The weights of each output pixel sum to one.
+/// </summary>
+/// <param name="srcLen">Source length</param>
+/// <param name="len">Output length</param>
+/// <param name="filter">Resampling filter</param>
+/// <returns>Weight table</returns>
+static ResampleWeights weights(int srcLen, int len, ResampleFilter filter) {
+  ResampleWeights ret;
+  ret.first.resize(len);
+  ret.count.resize(len);
+  ret.offset.resize(len);
+  double scale = (double)srcLen / (double)len;
+  for (int i = 0; i < len; i++) {
+    ret.offset[i] = (int)ret.weight.size();
+    if (filter == RESAMPLE_AREA) {
+      // overlaps of the source pixels with the area of the output pixel
+      double lo = i * scale, hi = std::min((i + 1) * scale, (double)srcLen);
+      int a = std::min((int)lo, srcLen - 1);
+      int b = std::max(std::min((int)std::ceil(hi), srcLen), a + 1);
+      double sum = 0;
+      for (int s = a; s < b; s++) {
+        sum += overlap(s, lo, hi);
+      }
+      for (int s = a; s < b; s++) {
+        double w = overlap(s, lo, hi);
+        ret.weight.push_back(sum > 0 ? (float)(w / sum) : 1.0f / (b - a));
+      }
+      ret.first[i] = a;
+      ret.count[i] = b - a;
+    } else {
+      // pixel centers are aligned, the border pixels are replicated
+      double x = std::min(std::max((i + 0.5) * scale - 0.5, 0.0),
+                          (double)(srcLen - 1));
+      int a = std::min((int)x, std::max(srcLen - 2, 0));
+      float f = (float)(x - a);
+      ret.first[i] = a;
+      if (srcLen == 1) {
+        ret.count[i] = 1;
+        ret.weight.push_back(1.0f);
+      } else {
+        ret.count[i] = 2;
+        ret.weight.push_back(1.0f - f);
+        ret.weight.push_back(f);
+      }
+    }
+  }
+  return ret;
+}
+
+/// <summary>
+/// Weighted sum of the rows to the output row.
+/// </summary>
+/// <param name="rows">First source row</param>
+/// <param name="rowStep">Distance of the source rows</param>
+/// <param name="weight">Row weights</param>
+/// <param name="count">Count of the rows</param>
+/// <param name="out">Output row</param>
+/// <param name="width">Row width</param>
+static void sumRows(const float* rows, int rowStep, const float* weight,
+                    int count, float* out, int width) {
+  for (int x = 0; x < width; x++) {
+    float sum = 0.0f;
+    for (int k = 0; k < count; k++) sum += rows[k * rowStep + x] * weight[k];
+    out[x] = sum;
+  }
+}
+
+/// <summary>
+/// AVX2 version of sumRows, eight columns are summed at once. The rows are
+/// summed in the same order, so the results are equal.
+/// </summary>
+/// <param name="rows">First source row</param>
+/// <param name="rowStep">Distance of the source rows</param>
+/// <param name="weight">Row weights</param>
+/// <param name="count">Count of the rows</param>
+/// <param name="out">Output row</param>
+/// <param name="width">Row width</param>
+TARGET_AVX2 static void sumRowsAVX2(const float* rows, int rowStep,
+                                    const float* weight, int count,
+                                    float* out, int width) {
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    __m256 sum = _mm256_setzero_ps();
+    for (int k = 0; k < count; k++) {
+      sum = _mm256_add_ps(
+          sum, _mm256_mul_ps(_mm256_loadu_ps(rows + k * rowStep + x),
+                             _mm256_set1_ps(weight[k])));
+    }
+    _mm256_storeu_ps(out + x, sum);
+  }
+  for (; x < width; x++) {
+    float sum = 0.0f;
+    for (int k = 0; k < count; k++) sum += rows[k * rowStep + x] * weight[k];
+    out[x] = sum;
+  }
+}
+
+/// <summary>
+/// Resamples the rows [from, to) to the output width, the taps of a pixel
+/// are contiguous.
+/// </summary>
+/// <param name="src">Source data</param>
+/// <param name="srcWidth">Source width</param>
+/// <param name="dst">Output data</param>
+/// <param name="stride">Distance of the output rows</param>
+/// <param name="wx">Weights of the columns</param>
+/// <param name="from">First row</param>
+/// <param name="to">Row after the last one</param>
+static void resampleRows(const float* src, int srcWidth, float* dst,
+                         int stride, const ResampleWeights& wx, int from,
+                         int to) {
+  int width = (int)wx.first.size();
+  for (int h = from; h < to; h++) {
+    const float* in = src + (size_t)h * srcWidth;
+    float* out = dst + (size_t)h * stride;
+    for (int x = 0; x < width; x++) {
+      const float* taps = in + wx.first[x];
+      const float* weight = wx.weight.data() + wx.offset[x];
+      float sum = 0.0f;
+      for (int k = 0; k < wx.count[x]; k++) sum += taps[k] * weight[k];
+      out[x] = sum;
+    }
+  }
+}
+
+/// <summary>
+/// Resamples the columns of the output rows [from, to), each output row is
+/// a weighted sum of whole source rows.
+/// </summary>
+/// <param name="src">Source data</param>
+/// <param name="width">Row width</param>
+/// <param name="dst">Output data</param>
+/// <param name="stride">Distance of the output rows</param>
+/// <param name="wy">Weights of the rows</param>
+/// <param name="from">First row</param>
+/// <param name="to">Row after the last one</param>
+/// <param name="avx2">Use AVX2 instructions</param>
+static void resampleColumns(const float* src, int width, float* dst,
+                            int stride, const ResampleWeights& wy, int from,
+                            int to, bool avx2) {
+  for (int y = from; y < to; y++) {
+    const float* rows = src + (size_t)wy.first[y] * width;
+    const float* weight = wy.weight.data() + wy.offset[y];
+    float* out = dst + (size_t)y * stride;
+    if (avx2) {
+      sumRowsAVX2(rows, width, weight, wy.count[y], out, width);
+    } else {
+      sumRows(rows, width, weight, wy.count[y], out, width);
+    }
+  }
+}
+
+void Resample::resize(const float* src, int srcWidth, int srcHeight,
+                      float* dst, int width, int height, int stride,
+                      ResampleFilter filter) {
+  assert(src != nullptr && dst != nullptr);
+  ResampleWeights wx = weights(srcWidth, width, filter);
+  ResampleWeights wy = weights(srcHeight, height, filter);
+  bool avx2 = Utils::hasAVX2();
+  Parallel::ThreadPool& pool = Parallel::ThreadPool::shared();
+
+  // the vectorized column pass goes first when it reduces the rows, the
+  // scalar row pass then processes less data
+  if (height < srcHeight) {
+    std::vector<float> colPass((size_t)srcWidth * height);
+    pool.parallelFor(
+        0, height,
+        [&](int from, int to) {
+          resampleColumns(src, srcWidth, colPass.data(), srcWidth, wy, from,
+                          to, avx2);
+        },
+        16);
+    pool.parallelFor(
+        0, height,
+        [&](int from, int to) {
+          resampleRows(colPass.data(), srcWidth, dst, stride, wx, from, to);
+        },
+        16);
+    return;
+  }
+  std::vector<float> rowPass((size_t)width * srcHeight);
+  pool.parallelFor(
+      0, srcHeight,
+      [&](int from, int to) {
+        resampleRows(src, srcWidth, rowPass.data(), width, wx, from, to);
+      },
+      16);
+  pool.parallelFor(
+      0, height,
+      [&](int from, int to) {
+        resampleColumns(rowPass.data(), width, dst, stride, wy, from, to,
+                        avx2);
+      },
+      16);
+}
+
+void Resample::resize(Image<float>& im, int width, int height,
+                      ResampleFilter filter) {
+  if (im.width() == width && im.height() == height) return;
+  Image<float> ret(width, height);
+  resize(im.data(), im.width(), im.height(), ret.data(), width, height,
+         width, filter);
+  im = std::move(ret);
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2022 - 2023 Tom Cicvrek, CTU in Prague, FEE
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef RESAMPLE__
+#define RESAMPLE__
+
+#define _CRTDBG_MAP_ALLOC
+#include <crtdbg.h>
+#include <stdlib.h>
+#ifdef _DEBUG
+#ifndef DBG_NEW
+#define DBG_NEW new (_NORMAL_BLOCK, __FILE__, __LINE__)
+#define new DBG_NEW
+#endif
+#endif  // _DEBUG
+
+#include "Image.h"
+#include "defines.h"
+
+/// <summary>
+/// Filters of the resampling.
+/// </summary>
+enum ResampleFilter {
+  RESAMPLE_AREA = 0,  // mean of the source area covered by the pixel
+  RESAMPLE_BILINEAR   // linear interpolation of the two nearest pixels
+};
+
+/// <summary>
+/// Resampling of float images. The weights of the source pixels are
+/// computed once for every output column and row. The image is resampled
+/// by rows and by columns separately, both passes run in parallel.
+/// </summary>
+static class Resample {
+ public:
+  /// <summary>
+  /// Resamples the image to the output buffer. The output may be a window
+  /// of a larger image.
+  /// </summary>
+  /// <param name="src">Source image data</param>
+  /// <param name="srcWidth">Source width</param>
+  /// <param name="srcHeight">Source height</param>
+  /// <param name="dst">Output data</param>
+  /// <param name="width">Output width</param>
+  /// <param name="height">Output height</param>
+  /// <param name="stride">Distance of the output rows</param>
+  /// <param name="filter">Resampling filter</param>
+  static void resize(const float* src, int srcWidth, int srcHeight,
+                     float* dst, int width, int height, int stride,
+                     ResampleFilter filter);
+
+  /// <summary>
+  /// Resamples the image, the result replaces the image data.
+  /// </summary>
+  /// <param name="im">Resampled image</param>
+  /// <param name="width">New width</param>
+  /// <param name="height">New height</param>
+  /// <param name="filter">Resampling filter</param>
+  static void resize(Image<float>& im, int width, int height,
+                     ResampleFilter filter);
+
+  /// <summary>
+  /// Filter suitable for the change of the size, the area filter for
+  /// reduction and the bilinear one for enlargement.
+  /// </summary>
+  /// <param name="srcWidth">Source width</param>
+  /// <param name="width">Output width</param>
+  /// <returns>Resampling filter</returns>
+  static ResampleFilter filterFor(int srcWidth, int width) {
+    return width < srcWidth ? RESAMPLE_AREA : RESAMPLE_BILINEAR;
+  }
+};
+
+#endif  // !RESAMPLE__
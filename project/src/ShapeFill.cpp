@@ -21,6 +21,8 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
 // OTHER DEALINGS IN THE SOFTWARE.
 
+#define _USE_MATH_DEFINES
+
 #define _CRTDBG_MAP_ALLOC
 #include <crtdbg.h>
 #include <stdlib.h>
@@ -32,10 +34,21 @@
 #endif  // _DEBUG
 
 #include <assert.h>
+#include <immintrin.h>
+
 #include <chrono>
+#include <cmath>
 
 #define SPACE 10
 #define ERR_VAL 0.00001f
+// pixels changing less drop out of the iterations until a neighbour changes
+#define DROP_VAL 0.000001f
+// size of the scaled down systems and limits of the scaling factor
+#define SCALE_UNKNOWNS 16384
+#define SCALE_MAX 16
+#define SCALE_MIN_SIZE 8
+// smoothing sweeps on the intermediate pyramid levels
+#define PYRAMID_SWEEPS 4
 
 //#define TIME_MEASURE
 
@@ -47,20 +60,61 @@
 #include <sstream>
 #include <string>
 #include <list>
+#include <memory>
 
 #include "../dependencies/dt/dt.h"
+#include "ColorKernels.h"
+#include "ImageCache.h"
 #include "MatriceSolve.h"
+#include "Morphology.h"
+#include "Parallel.h"
 #include "ShapeFill.h"
 #include "Utils.h"
-#include "zip.h"
+
+/// <summary>
+/// Parallel loop of the shared pool, runs the lines of the distance
+/// transform.
+/// </summary>
+struct PoolFor {
+  template <typename F>
+  void operator()(int begin, int end, const F& body, int grain) const {
+    Parallel::ThreadPool::shared().parallelFor(begin, end, body, grain);
+  }
+};
 
 ShapeFill::ShapeFill() {
   strength = 1.0f;
   scale = 2.0f;
+  adaptiveScale = true;
+  solver = MULTIGRID;
+  pyramid = false;
+  pcgRefine = false;
+  pcgTolerance = PCG_TOLERANCE;
+  chebyshev = true;
+  maxIterations = SOR_MAX_ITERATIONS;
+  timeBudget = 0.0f;
 }
 
 ShapeFill::~ShapeFill() {}
 
+const std::map<BYTE, SolverStats>& ShapeFill::solverStats() const {
+  return stats;
+}
+
+void ShapeFill::setSolver(LaplaceSolver backend) { solver = backend; }
+
+void ShapeFill::setRefinement(bool pcg, float tolerance) {
+  pcgRefine = pcg;
+  pcgTolerance = tolerance;
+}
+
+void ShapeFill::setBudget(int iterations, float milliseconds) {
+  maxIterations = iterations;
+  timeBudget = milliseconds;
+}
+
+void ShapeFill::setPyramid(bool enabled) { pyramid = enabled; }
+
 /// <summary>
 /// Debugging function for visualizing data in floating point arrays
 /// </summary>
@@ -89,177 +143,670 @@ bool floatWrite(float* image, int width, int height,
   return imwrite(rgbImage, fileName);
 }
 
-void ShapeFill::GaussSeidelVar(float* compSpace, float* dists, float* borders,
-                               int width, int height) {
-  int iter = 0;       // count of passed iterations
+/// <summary>
+/// Unknown pixels of the working space stored as structure of arrays in the
+/// lexicographic order, so the iterations touch only the real unknowns.
+/// </summary>
+struct Worklist {
+  std::vector<int> pos;         // positions in the working space
+  std::vector<int> col, row;    // coordinates for the variable kernel
+  std::vector<float> radius;    // distance to the boundary
+  std::vector<int> up, down;    // unit kernel neighbours, -1 out of image
+  std::vector<int> left, right;
+  std::vector<float> denum;     // count of the unit kernel neighbours
+  std::vector<int> index;       // entry of each position, -1 if known
+  std::vector<int> rowFirst;    // first unknown column of each row
+  std::vector<int> rowLast;     // last unknown column, lower if none
+  float maxRadius;
+};
+
+/// <summary>
+/// Expands pixel labels to the float image of the linear system.
+/// </summary>
+/// <param name="labels">Pixel labels</param>
+/// <param name="size">Count of the pixels</param>
+/// <returns>Image of the label values</returns>
+static float* labelImage(const BYTE* labels, int size) {
+  float* img = new float[size];
+  assert(img != nullptr);
+  for (int i = 0; i < size; i++) img[i] = labelValue(labels[i]);
+  return img;
+}
+
+/// <summary>
+/// Collects the unknown pixels and precomputes their neighbours.
+/// </summary>
+/// <param name="list">Output list</param>
+/// <param name="compSpace">Working space, empty space is -1</param>
+/// <param name="dists">Distance transform, nullptr to take the unknowns
+/// from the boundary conditions with the unit radius</param>
+/// <param name="borders">Labels of the boundary conditions</param>
+/// <param name="width">Image selection width</param>
+/// <param name="height">Image selection height</param>
+static void buildWorklist(Worklist& list, const float* compSpace,
+                          const float* dists, const BYTE* borders, int width,
+                          int height) {
+  list.index.assign(width * height, -1);
+  list.rowFirst.assign(height, width);
+  list.rowLast.assign(height, -1);
+  list.maxRadius = 0.0f;
+  for (int h = 0; h < height; h++) {
+    for (int w = 0; w < width; w++) {
+      int pos = w + h * width;
+      bool unknown = dists != nullptr ? dists[pos] != 0.0f
+                                      : borders[pos] == PX_GREY;
+      if (!unknown || compSpace[pos] == -1.0f) continue;
+      list.index[pos] = (int)list.pos.size();
+      list.pos.push_back(pos);
+      list.col.push_back(w);
+      list.row.push_back(h);
+      float radius = dists != nullptr ? dists[pos] : 1.0f;
+      list.radius.push_back(radius);
+      list.maxRadius = std::max(list.maxRadius, radius);
+      list.up.push_back(h > 0 ? pos - width : -1);
+      list.down.push_back(h < height - 1 ? pos + width : -1);
+      list.left.push_back(w > 0 ? pos - 1 : -1);
+      list.right.push_back(w < width - 1 ? pos + 1 : -1);
+      list.denum.push_back((float)((h > 0) + (h < height - 1) + (w > 0) +
+                                   (w < width - 1)));
+      list.rowFirst[h] = std::min(list.rowFirst[h], w);
+      list.rowLast[h] = w;
+    }
+  }
+}
+
+/// <summary>
+/// Relaxes one unknown pixel with the unit kernel.
+/// </summary>
+/// <param name="list">Unknown pixels</param>
+/// <param name="compSpace">Working space</param>
+/// <param name="i">Entry of the pixel</param>
+/// <returns>Change of the pixel</returns>
+static inline float relaxUnit(const Worklist& list, float* compSpace, int i) {
+  float sum = 0.0f;
+  if (list.up[i] >= 0) sum += compSpace[list.up[i]];
+  if (list.down[i] >= 0) sum += compSpace[list.down[i]];
+  if (list.left[i] >= 0) sum += compSpace[list.left[i]];
+  if (list.right[i] >= 0) sum += compSpace[list.right[i]];
+  float at = compSpace[list.pos[i]];
+  compSpace[list.pos[i]] = sum / list.denum[i];
+  return std::abs(at - compSpace[list.pos[i]]);
+}
+
+/// <summary>
+/// Marks the unknown unit kernel neighbours of the pixel to be relaxed.
+/// </summary>
+/// <param name="list">Unknown pixels</param>
+/// <param name="active">Flags of the pixels relaxed in the next sweep</param>
+/// <param name="i">Entry of the changed pixel</param>
+static inline void activateNeighbours(const Worklist& list,
+                                      std::vector<char>& active, int i) {
+  const int neighbours[4] = {list.up[i], list.down[i], list.left[i],
+                             list.right[i]};
+  for (int n : neighbours) {
+    if (n >= 0 && list.index[n] >= 0) active[list.index[n]] = 1;
+  }
+}
+
+/// <summary>
+/// Unit kernel sweep over the active pixels. A pixel which changed less than
+/// DROP_VAL drops out until some of its neighbours changes.
+/// </summary>
+/// <param name="list">Unknown pixels</param>
+/// <param name="active">Flags of the relaxed pixels</param>
+/// <param name="compSpace">Working space</param>
+/// <returns>Whether some pixel changed more than the error value</returns>
+static bool sweepActive(const Worklist& list, std::vector<char>& active,
+                        float* compSpace) {
+  bool changed = false;
+  for (int i = 0; i < (int)list.pos.size(); i++) {
+    if (!active[i]) continue;
+    active[i] = 0;
+    float change = relaxUnit(list, compSpace, i);
+    if (change > DROP_VAL) activateNeighbours(list, active, i);
+    if (change > ERR_VAL) changed = true;
+  }
+  return changed;
+}
+
+/// <summary>
+/// Relaxes pixels of one color in a row with the variable kernel. Kernel
+/// distances are forced odd, so only pixels of the other color are read.
+/// The pixels move by omega times their residual.
+/// </summary>
+/// <param name="compSpace">Working space</param>
+/// <param name="dists">Distance transform</param>
+/// <param name="width">Image selection width</param>
+/// <param name="height">Image selection height</param>
+/// <param name="h">Row</param>
+/// <param name="from">First column, its color is relaxed</param>
+/// <param name="to">Column after the last one</param>
+/// <param name="scale">Scaling factor of the variable kernel</param>
+/// <param name="omega">Over-relaxation factor</param>
+/// <returns>Largest residual of the pixels</returns>
+static float relaxRowRB(float* compSpace, const float* dists, int width,
+                        int height, int h, int from, int to, float scale,
+                        float omega) {
+  float changed = 0.0f;
+  for (int w = from; w < to; w += 2) {
+    int pos = w + h * width;
+
+    // skip boundary positions and empty space
+    if (dists[pos] == 0.0f || compSpace[pos] == -1.0f) continue;
+
+    int dist = std::max(dists[pos] * scale, 1.0f);
+    dist -= 1 - (dist & 1);
+    float denum = 0.0f, sum = 0.0f;
+    if (h - dist >= 0) {
+      sum += compSpace[pos - dist * width];
+      denum += 1;
+    }
+    if (h + dist < height) {
+      sum += compSpace[pos + dist * width];
+      denum += 1;
+    }
+    if (w - dist >= 0) {
+      sum += compSpace[pos - dist];
+      denum += 1;
+    }
+    if (w + dist < width) {
+      sum += compSpace[pos + dist];
+      denum += 1;
+    }
+
+    float residual = sum / denum - compSpace[pos];
+    compSpace[pos] += omega * residual;
+    changed = std::max(changed, std::abs(residual));
+  }
+  return changed;
+}
+
+/// <summary>
+/// Lanes of the active mask where a is greater than b.
+/// </summary>
+TARGET_AVX2 static inline __m256 insideMask(__m256 active, __m256i a,
+                                            __m256i b) {
+  return _mm256_and_ps(active, _mm256_castsi256_ps(_mm256_cmpgt_epi32(a, b)));
+}
+
+/// <summary>
+/// Largest of the lanes.
+/// </summary>
+TARGET_AVX2 static inline float maxLane(__m256 v) {
+  __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+  m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+  return _mm_cvtss_f32(m);
+}
+
+/// <summary>
+/// AVX2 version of relaxRowRB. Eight neighbouring pixels are processed at
+/// once, the pixels of the other color and the skipped ones are masked out,
+/// as well as the kernel samples out of the image.
+/// </summary>
+/// <param name="compSpace">Working space</param>
+/// <param name="dists">Distance transform</param>
+/// <param name="width">Image selection width</param>
+/// <param name="height">Image selection height</param>
+/// <param name="h">Row</param>
+/// <param name="lo">First column</param>
+/// <param name="hi">Column after the last one</param>
+/// <param name="color">Relaxed color, parity of the column plus row</param>
+/// <param name="scale">Scaling factor of the variable kernel</param>
+/// <param name="omega">Over-relaxation factor</param>
+/// <returns>Largest residual of the pixels</returns>
+TARGET_AVX2 static float relaxRowRBAVX2(float* compSpace, const float* dists,
+                                        int width, int height, int h, int lo,
+                                        int hi, int color, float scale,
+                                        float omega) {
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i ones = _mm256_set1_epi32(1);
+  const __m256i minusOne = _mm256_set1_epi32(-1);
+  const __m256i vWidth = _mm256_set1_epi32(width);
+  const __m256i vHeight = _mm256_set1_epi32(height);
+  const __m256i vRow = _mm256_set1_epi32(h);
+  const __m256 vScale = _mm256_set1_ps(scale);
+  const __m256 vOmega = _mm256_set1_ps(omega);
+  const __m256 vOne = _mm256_set1_ps(1.0f);
+  const __m256 vZero = _mm256_setzero_ps();
+  const __m256 vEmpty = _mm256_set1_ps(-1.0f);
+  const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  // lanes of the relaxed color
+  const __m256i colorMask = _mm256_cmpeq_epi32(
+      _mm256_and_si256(
+          _mm256_add_epi32(lanes, _mm256_set1_epi32(lo + h + color)), ones),
+      _mm256_setzero_si256());
+  __m256 changed = vZero;
+  int w = lo;
+  for (; w + 8 <= hi; w += 8) {
+    int pos = w + h * width;
+    __m256 d = _mm256_loadu_ps(dists + pos);
+    __m256 at = _mm256_loadu_ps(compSpace + pos);
+    // skip boundary positions and empty space
+    __m256 active = _mm256_and_ps(
+        _mm256_castsi256_ps(colorMask),
+        _mm256_andnot_ps(_mm256_cmp_ps(at, vEmpty, _CMP_EQ_OQ),
+                         _mm256_cmp_ps(d, vZero, _CMP_NEQ_OQ)));
+    if (_mm256_movemask_ps(active) == 0) continue;
+
+    __m256i dist =
+        _mm256_cvttps_epi32(_mm256_max_ps(_mm256_mul_ps(d, vScale), vOne));
+    // odd distances only
+    dist = _mm256_sub_epi32(
+        dist, _mm256_xor_si256(_mm256_and_si256(dist, ones), ones));
+    __m256i col = _mm256_add_epi32(_mm256_set1_epi32(w), lanes);
+    __m256i idx = _mm256_add_epi32(_mm256_set1_epi32(pos), lanes);
+    __m256i rowOff = _mm256_mullo_epi32(dist, vWidth);
+
+    // samples inside of the image
+    __m256 mU = insideMask(active, _mm256_sub_epi32(vRow, dist), minusOne);
+    __m256 mD = insideMask(active, vHeight, _mm256_add_epi32(vRow, dist));
+    __m256 mL = insideMask(active, _mm256_sub_epi32(col, dist), minusOne);
+    __m256 mR = insideMask(active, vWidth, _mm256_add_epi32(col, dist));
+
+    __m256 sum = _mm256_mask_i32gather_ps(
+        vZero, compSpace, _mm256_sub_epi32(idx, rowOff), mU, 4);
+    sum = _mm256_add_ps(sum, _mm256_mask_i32gather_ps(
+                                 vZero, compSpace,
+                                 _mm256_add_epi32(idx, rowOff), mD, 4));
+    sum = _mm256_add_ps(sum, _mm256_mask_i32gather_ps(
+                                 vZero, compSpace,
+                                 _mm256_sub_epi32(idx, dist), mL, 4));
+    sum = _mm256_add_ps(sum, _mm256_mask_i32gather_ps(
+                                 vZero, compSpace,
+                                 _mm256_add_epi32(idx, dist), mR, 4));
+    __m256 denum = _mm256_add_ps(
+        _mm256_add_ps(_mm256_and_ps(mU, vOne), _mm256_and_ps(mD, vOne)),
+        _mm256_add_ps(_mm256_and_ps(mL, vOne), _mm256_and_ps(mR, vOne)));
+
+    __m256 residual = _mm256_sub_ps(_mm256_div_ps(sum, denum), at);
+    __m256 val = _mm256_add_ps(at, _mm256_mul_ps(vOmega, residual));
+    __m256 diff = _mm256_and_ps(residual, absMask);
+    changed = _mm256_max_ps(changed, _mm256_and_ps(active, diff));
+    // only the relaxed pixels are written, the rest is read by other threads
+    _mm256_maskstore_ps(compSpace + pos, _mm256_castps_si256(active), val);
+  }
+  float ret = maxLane(changed);
+  // the scalar code must not run with dirty upper halves of the registers
+  _mm256_zeroupper();
+  // remaining pixels of the row
+  int from = w + ((w + h + color) & 1);
+  return std::max(ret, relaxRowRB(compSpace, dists, width, height, h, from,
+                                  hi, scale, omega));
+}
+
+/// <summary>
+/// AVX2 version of relaxRowRB for the unit kernel, which is used in most of
+/// the iterations. The neighbours are read by unaligned loads, except the
+/// left ones, which are shifted from the registers (loading them would hit
+/// the store of the previous pixels and stall). Only the inner part of the
+/// row is vectorized, so the samples never leave the image and need no
+/// bounds tests.
+/// </summary>
+/// <param name="compSpace">Working space</param>
+/// <param name="dists">Distance transform</param>
+/// <param name="width">Image selection width</param>
+/// <param name="height">Image selection height</param>
+/// <param name="h">Row, not the first or the last one</param>
+/// <param name="lo">First column</param>
+/// <param name="hi">Column after the last one</param>
+/// <param name="color">Relaxed color, parity of the column plus row</param>
+/// <param name="omega">Over-relaxation factor</param>
+/// <returns>Largest residual of the pixels</returns>
+TARGET_AVX2 static float relaxRowRBUnitAVX2(float* compSpace,
+                                            const float* dists, int width,
+                                            int height, int h, int lo, int hi,
+                                            int color, float omega) {
+  // the first column is not vectorized
+  float ret = lo == 0 ? relaxRowRB(compSpace, dists, width, height, h,
+                                   (h + color) & 1, 1, 0.0f, omega)
+                      : 0.0f;
+  int w = std::max(lo, 1);
+  const __m256 vZero = _mm256_setzero_ps();
+  const __m256 vEmpty = _mm256_set1_ps(-1.0f);
+  const __m256 vQuarter = _mm256_set1_ps(0.25f);
+  const __m256 vOmega = _mm256_set1_ps(omega);
+  const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  // lanes of the relaxed color
+  const __m256 colorMask = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+      _mm256_and_si256(
+          _mm256_add_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                           _mm256_set1_epi32(w + h + color)),
+          _mm256_set1_epi32(1)),
+      _mm256_setzero_si256()));
+  __m256 changed = vZero;
+  __m256 prev = _mm256_set1_ps(compSpace[w - 1 + h * width]);
+  for (; w + 8 <= hi && w + 8 < width; w += 8) {
+    const float* at = compSpace + w + h * width;
+    __m256 d = _mm256_loadu_ps(dists + w + h * width);
+    __m256 old = _mm256_loadu_ps(at);
+    // left neighbours, the last pixel of the previous chunk and old shifted
+    __m256 left = _mm256_castsi256_ps(_mm256_alignr_epi8(
+        _mm256_castps_si256(old),
+        _mm256_castps_si256(_mm256_permute2f128_ps(prev, old, 0x21)), 12));
+    prev = old;
+    // skip boundary positions and empty space
+    __m256 active = _mm256_and_ps(
+        colorMask, _mm256_andnot_ps(_mm256_cmp_ps(old, vEmpty, _CMP_EQ_OQ),
+                                    _mm256_cmp_ps(d, vZero, _CMP_NEQ_OQ)));
+    if (_mm256_movemask_ps(active) == 0) continue;
+
+    __m256 sum = _mm256_add_ps(
+        _mm256_add_ps(
+            _mm256_add_ps(_mm256_loadu_ps(at - width),
+                          _mm256_loadu_ps(at + width)),
+            left),
+        _mm256_loadu_ps(at + 1));
+    __m256 residual = _mm256_sub_ps(_mm256_mul_ps(sum, vQuarter), old);
+    __m256 val = _mm256_add_ps(old, _mm256_mul_ps(vOmega, residual));
+    __m256 diff = _mm256_and_ps(residual, absMask);
+    changed = _mm256_max_ps(changed, _mm256_and_ps(active, diff));
+    // only the relaxed pixels are written, the rest is read by other threads
+    _mm256_maskstore_ps(compSpace + w + h * width,
+                        _mm256_castps_si256(active), val);
+  }
+  ret = std::max(ret, maxLane(changed));
+  _mm256_zeroupper();
+  // remaining pixels of the row
+  int from = w + ((w + h + color) & 1);
+  return std::max(ret, relaxRowRB(compSpace, dists, width, height, h, from,
+                                  hi, 0.0f, omega));
+}
+
+SolverStats ShapeFill::GaussSeidelVarRB(float* compSpace, float* dists,
+                                        int width, int height) {
+  auto start = std::chrono::steady_clock::now();
+  Parallel::ThreadPool& pool = Parallel::ThreadPool::shared();
+  bool avx2 = Utils::hasAVX2();
+  float maxDist = 0.0f;
+  for (int i = 0; i < width * height; i++) {
+    maxDist = std::max(maxDist, dists[i]);
+  }
+  // columns of the unknown pixels in each row, the rest is never relaxed
+  std::vector<int> rowFirst(height, width), rowLast(height, -1);
+  int minCol = width, maxCol = -1, minRow = height, maxRow = -1;
+  for (int h = 0; h < height; h++) {
+    for (int w = 0; w < width; w++) {
+      int pos = w + h * width;
+      if (dists[pos] == 0.0f || compSpace[pos] == -1.0f) continue;
+      rowFirst[h] = std::min(rowFirst[h], w);
+      rowLast[h] = w;
+    }
+    if (rowFirst[h] > rowLast[h]) continue;
+    minCol = std::min(minCol, rowFirst[h]);
+    maxCol = std::max(maxCol, rowLast[h]);
+    minRow = std::min(minRow, h);
+    maxRow = h;
+  }
+  if (maxRow < 0) {
+    // the closer segments cannot hide any part of the segment
+    SolverStats none;
+    none.converged = true;
+    return none;
+  }
+  // Jacobi spectral radius of the bounding rectangle of the unknowns, it
+  // drives the Chebyshev sequence of the over-relaxation factors
+  float rho = 0.5f * (std::cos(M_PI / (float)(maxCol - minCol + 2)) +
+                      std::cos(M_PI / (float)(maxRow - minRow + 2)));
+  float omega = 1.0f;
+  int halfSweeps = 0;  // red-black half sweeps with the unit kernel
+  auto nextOmega = [&]() {
+    if (chebyshev && halfSweeps == 1)
+      omega = 1.0f / (1.0f - 0.5f * rho * rho);
+    else if (chebyshev && halfSweeps > 1)
+      omega = 1.0f / (1.0f - 0.25f * rho * rho * omega);
+    halfSweeps++;
+    return omega;
+  };
+  // rows relaxed in the iteration, rows which changed in it and the last
+  // residual of each row
+  std::vector<char> rowActive(height, 1), rowChanged(height, 0);
+  std::vector<float> rowResidual(height, 0.0f);
+  // bands of rows swept by one thread in the unit iterations
+  int bands = std::max(1, std::min(Parallel::threadCount(), height / 8));
+  SolverStats stats;
   bool done = false;  // condition to end the computetion
-  while (!done || iter < ITERATIONS) {
-    done = true;
-    iter++;
+  while (!done || stats.iterations < ITERATIONS) {
+    if (stats.iterations >= ITERATIONS) {
+      // budgets of the segment, the variable kernel iterations always run
+      if (stats.iterations >= maxIterations) break;
+      if (timeBudget > 0.0f && std::chrono::duration<float, std::milli>(
+                                   std::chrono::steady_clock::now() - start)
+                                       .count() > timeBudget)
+        break;
+    }
+    int iter = ++stats.iterations;
 
     float scale = 1.0f;            // scaling factor of the variable kernel
     if (iter >= ITERATIONS / 2) {  // condition to the shrink half strategy
       scale = 1.0f - (float)iter / (float)ITERATIONS;
     }
-    for (int h = 0; h < height; h++) {
-      for (int w = 0; w < width; w++) {
-        int pos = w + h * width;
-
-        // skip boundary positions and empty space
-        if (dists[pos] == 0.0f || compSpace[pos] == -1.0f) continue;
-
-        int dist = std::max(dists[pos] * scale, 1.0f);
-        float denum = 0.0f, sum = 0.0f;
-        int dirUp = h - dist, dirDown = h + dist, dirLeft = w - dist,
-            dirRight = w + dist;
-
-        // manage width / height coordinates
-        if (dirUp >= 0 && dirUp < height) {
-          sum += compSpace[w + dirUp * width];
-          denum += 1;
-        }
-        if (dirDown < height && dirDown >= 0) {
-          sum += compSpace[w + dirDown * width];
-          denum += 1;
-        }
-        if (dirLeft >= 0 && dirLeft < width) {
-          sum += compSpace[dirLeft + h * width];
-          denum += 1;
+    // all kernels are shrinked to the direct neighbours
+    bool unit = maxDist * scale < 2.0f;
+    // the variable kernel changes each iteration, only the unit kernel
+    // iterations are accelerated
+    float omegas[2] = {1.0f, 1.0f};
+    if (unit) {
+      omegas[0] = nextOmega();
+      omegas[1] = nextOmega();
+    }
+    auto relaxRow = [&](int h, int color) {
+      if (!rowActive[h] || rowFirst[h] > rowLast[h]) return;
+      int lo = rowFirst[h], hi = rowLast[h] + 1;
+      float c;
+      if (!avx2)
+        c = relaxRowRB(compSpace, dists, width, height, h,
+                       lo + ((lo + h + color) & 1), hi, scale, omegas[color]);
+      else if (unit && h > 0 && h < height - 1)
+        c = relaxRowRBUnitAVX2(compSpace, dists, width, height, h, lo, hi,
+                               color, omegas[color]);
+      else
+        c = relaxRowRBAVX2(compSpace, dists, width, height, h, lo, hi, color,
+                           scale, omegas[color]);
+      if (c > DROP_VAL) rowChanged[h] = 1;
+      // both colors of the row are relaxed in the iteration
+      rowResidual[h] = color == 0 ? c : std::max(rowResidual[h], c);
+    };
+    if (unit) {
+      // both colors in one sweep of a band, the black row follows the red
+      // one, so the rows are read once while in the cache; the edge rows
+      // of the bands read the neighbouring bands and are done afterwards
+      pool.parallelFor(0, bands, [&](int from, int to) {
+        for (int b = from; b < to; b++) {
+          int first = height * b / bands, last = height * (b + 1) / bands;
+          for (int h = first; h < last; h++) {
+            relaxRow(h, 0);
+            if (h - 1 > first) relaxRow(h - 1, 1);
+          }
         }
-        if (dirRight < width && dirRight >= 0) {
-          sum += compSpace[dirRight + h * width];
-          denum += 1;
+      });
+      pool.parallelFor(0, bands, [&](int from, int to) {
+        for (int b = from; b < to; b++) {
+          int first = height * b / bands, last = height * (b + 1) / bands;
+          relaxRow(first, 1);
+          if (last - 1 > first) relaxRow(last - 1, 1);
         }
-
-        float at = compSpace[w + h * width];  // save the current value to
-                                              // observe change in the pixel
-        compSpace[pos] = sum / denum;
-        if (std::abs(at - compSpace[w + h * width]) > ERR_VAL)
-          done = false;  // condition to determine the end of iterations
+      });
+    } else {
+      for (int color = 0; color < 2; color++) {
+        // pixels of one color read only the other one, rows are independent
+        pool.parallelFor(
+            0, height,
+            [&](int from, int to) {
+              for (int h = from; h < to; h++) relaxRow(h, color);
+            },
+            8);
       }
     }
+    // maximum norm of the residual, the rows which dropped out keep the
+    // residual of their last relaxation
+    stats.residual = 0.0f;
+    for (int h = 0; h < height; h++) {
+      stats.residual = std::max(stats.residual, rowResidual[h]);
+    }
+    done = stats.residual <= ERR_VAL;
+    if (unit) {
+      // converged rows drop out until they or their neighbours change
+      for (int h = 0; h < height; h++) {
+        rowActive[h] = rowChanged[h] || (h > 0 && rowChanged[h - 1]) ||
+                       (h < height - 1 && rowChanged[h + 1]);
+      }
+    }
+    std::fill(rowChanged.begin(), rowChanged.end(), 0);
   }
+  stats.converged = done;
+  stats.time = std::chrono::duration<float, std::milli>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
 #ifdef TIME_MEASURE
-  std::cout << "VK iterations " << iter << std::endl;
+  std::cout << "VK red-black iterations " << stats.iterations
+            << ", residual " << stats.residual << std::endl;
 #endif
+  return stats;
 }
 
-
-void ShapeFill::GaussSeidel(float* compSpace, float* borders,
-                               int width, int height) {
+void ShapeFill::GaussSeidelVar(float* compSpace, float* dists,
+                               const BYTE* borders, int width, int height) {
+  Worklist list;
+  buildWorklist(list, compSpace, dists, borders, width, height);
+  int n = (int)list.pos.size();
+  std::vector<char> active(n, 1);
   int iter = 0;       // count of passed iterations
   bool done = false;  // condition to end the computetion
   while (!done || iter < ITERATIONS) {
     done = true;
     iter++;
-    for (int h = 0; h < height; h++) {
-      for (int w = 0; w < width; w++) {
-        int pos = w + h * width;
 
-        // skip boundary positions and empty space
-        if (borders[pos] != 0.5f || compSpace[pos] == -1.0f) continue;
+    float scale = 1.0f;            // scaling factor of the variable kernel
+    if (iter >= ITERATIONS / 2) {  // condition to the shrink half strategy
+      scale = 1.0f - (float)iter / (float)ITERATIONS;
+    }
+    // all kernels are shrinked to the direct neighbours
+    if (list.maxRadius * scale < 2.0f) {
+      done = !sweepActive(list, active, compSpace);
+      continue;
+    }
+    for (int i = 0; i < n; i++) {
+      int w = list.col[i], h = list.row[i], pos = list.pos[i];
+
+      int dist = std::max(list.radius[i] * scale, 1.0f);
+      float denum = 0.0f, sum = 0.0f;
+      int dirUp = h - dist, dirDown = h + dist, dirLeft = w - dist,
+          dirRight = w + dist;
+
+      // manage width / height coordinates
+      if (dirUp >= 0) {
+        sum += compSpace[w + dirUp * width];
+        denum += 1;
+      }
+      if (dirDown < height) {
+        sum += compSpace[w + dirDown * width];
+        denum += 1;
+      }
+      if (dirLeft >= 0) {
+        sum += compSpace[dirLeft + h * width];
+        denum += 1;
+      }
+      if (dirRight < width) {
+        sum += compSpace[dirRight + h * width];
+        denum += 1;
+      }
 
-        float denum = 0.0f, sum = 0.0f;
-        int dirUp = h - 1, dirDown = h + 1, dirLeft = w - 1,
-            dirRight = w + 1;
+      float at = compSpace[pos];  // save the current value to
+                                  // observe change in the pixel
+      compSpace[pos] = sum / denum;
+      if (std::abs(at - compSpace[pos]) > ERR_VAL)
+        done = false;  // condition to determine the end of iterations
+    }
+  }
+#ifdef TIME_MEASURE
+  std::cout << "VK iterations " << iter << std::endl;
+#endif
+}
 
-        // manage width / height coordinates
-        if (dirUp >= 0 && dirUp < height) {
-          sum += compSpace[w + dirUp * width];
-          denum += 1;
-        }
-        if (dirDown < height && dirDown >= 0) {
-          sum += compSpace[w + dirDown * width];
-          denum += 1;
-        }
-        if (dirLeft >= 0 && dirLeft < width) {
-          sum += compSpace[dirLeft + h * width];
-          denum += 1;
-        }
-        if (dirRight < width && dirRight >= 0) {
-          sum += compSpace[dirRight + h * width];
-          denum += 1;
-        }
 
-        float at = compSpace[w + h * width];  // save the current value to
-                                              // observe change in the pixel
-        compSpace[pos] = sum / denum;
-        if (std::abs(at - compSpace[w + h * width]) > ERR_VAL)
-          done = false;  // condition to determine the end of iterations
-      }
-    }
+void ShapeFill::GaussSeidel(float* compSpace, const BYTE* borders,
+                               int width, int height) {
+  Worklist list;
+  buildWorklist(list, compSpace, nullptr, borders, width, height);
+  std::vector<char> active(list.pos.size(), 1);
+  int iter = 0;       // count of passed iterations
+  bool done = false;  // condition to end the computetion
+  while (!done || iter < ITERATIONS) {
+    iter++;
+    done = !sweepActive(list, active, compSpace);
   }
   std::cout << "NK iterations " << iter << std::endl;
 }
 
-float* ShapeFill::scaleDown(float* img, int width, int height, int& newWidth,
-                            int& newHeight) {
+BYTE* ShapeFill::scaleDown(const BYTE* img, int width, int height,
+                           int& newWidth, int& newHeight, int factor) {
   // pad the new image so it can be interpolated later up to its boundaries
-  newWidth = std::ceil((float)width / scale) + 1;
-  newHeight = std::ceil((float)height / scale) + 1;
-  float* newim = new float[newWidth * newHeight];
+  newWidth = (width + factor - 1) / factor + 1;
+  newHeight = (height + factor - 1) / factor + 1;
+  BYTE* newim = new BYTE[newWidth * newHeight];
   assert(newim != nullptr);
 
   // go through the bigger image and find positions in the scaled image
   for (int h = 0; h < newHeight; h++) {
-    int hStart = h * scale;
+    int hStart = h * factor;
     for (int w = 0; w < newWidth; w++) {
-      int wStart = w * scale;
+      int wStart = w * factor;
       // initialize counter for black and white pixels in the interpolated area
       int cnts[2] = {0, 0};
-      for (int i = 0; i < scale; i++) {
+      for (int i = 0; i < factor; i++) {
         int hCoord = i + hStart;
         if (hCoord >= height) continue;
-        for (int j = 0; j < scale; j++) {
+        for (int j = 0; j < factor; j++) {
           int wCoord = j + wStart;
           if (wCoord >= width) continue;
           // increase counter at valid pixels if possible
-          if (img[hCoord * width + wCoord] != 0.5f)
-            cnts[(int)img[hCoord * width + wCoord]] += 1;
+          if (img[hCoord * width + wCoord] != PX_GREY)
+            cnts[img[hCoord * width + wCoord] - PX_BLACK] += 1;
         }
       }
       // if the number of non-grey pixels is smaller than half of the
       // interpolated area, set the pixel as grey
       if ((cnts[0] == 0 && cnts[1] == 0) ||
-          cnts[0] + cnts[1] < scale * scale / 2) {
-        newim[w + h * newWidth] = 0.5f;
+          cnts[0] + cnts[1] < factor * factor / 2) {
+        newim[w + h * newWidth] = PX_GREY;
         continue;
       }
       // othervise choose the color of majority of the pixels in the
       // interpolated area
       if (cnts[0] > cnts[1]) {
-        newim[w + h * newWidth] = 0.0f;
+        newim[w + h * newWidth] = PX_BLACK;
         continue;
       }
-      newim[w + h * newWidth] = 1.0f;
+      newim[w + h * newWidth] = PX_WHITE;
     }
   }
   return newim;
 }
 
-void ShapeFill::scaleUp(float* img, float* scaled, int width, int height,
-                        int scaledWidth) {
+void ShapeFill::scaleUp(const BYTE* img, float* out, const float* scaled,
+                        int width, int height, int scaledWidth, int factor) {
   int prevW, prevH, coord;
   float coeffs[2];
   for (int h = 0; h < height; h++) {
     for (int w = 0; w < width; w++) {
       // skip the already known background pixels
-      if (img[w + h * width] != 0.0f) {
-        img[w + h * width] = -1.0f;
+      if (img[w + h * width] != PX_BLACK) {
+        out[w + h * width] = -1.0f;
         continue;
       }
       // position of the first pixels of the square interpolated area in the
       // smaller image
-      prevW = w / scale;
-      prevH = h / scale;
+      prevW = w / factor;
+      prevH = h / factor;
       // scale coefficients used in the interpolation
-      coeffs[0] = (float)(w % (int)scale) / scale;
-      coeffs[1] = (float)(h % (int)scale) / scale;
+      coeffs[0] = (float)(w % factor) / factor;
+      coeffs[1] = (float)(h % factor) / factor;
       coord = prevW + prevH * scaledWidth;
 
       // linear interpolation of the pixel in the new image depending on four
       // pixels in the smaller image
-      img[w + h * width] =
+      out[w + h * width] =
           (scaled[coord] < 0.0f ? 0.0f : scaled[coord]) * (1.0f - coeffs[0]) *
               (1.0f - coeffs[1]) +
           (scaled[coord + 1] < 0.0f ? 0.0f : scaled[coord + 1]) * coeffs[0] *
@@ -275,6 +822,57 @@ void ShapeFill::scaleUp(float* img, float* scaled, int width, int height,
   }
 }
 
+int ShapeFill::segmentScale(const BYTE* img, int width, int height) {
+  if (!adaptiveScale) return (int)scale;
+  // pixels of the closer segments are the unknowns
+  int unknowns = 0;
+  for (int i = 0; i < width * height; i++) {
+    if (img[i] == PX_BLACK) unknowns++;
+  }
+  int factor = 1;
+  while (unknowns / (factor * factor) > SCALE_UNKNOWNS && factor < SCALE_MAX &&
+         std::min(width, height) / (factor * 2) >= SCALE_MIN_SIZE) {
+    factor *= 2;
+  }
+  return factor;
+}
+
+float* ShapeFill::prolong(const BYTE* img, int width, int height,
+                          float* coarse, int& coarseWidth, int& coarseHeight,
+                          int& factor) {
+  factor /= 2;
+  int levelW, levelH;
+  BYTE* labels = scaleDown(img, width, height, levelW, levelH, factor);
+  BYTE* bound = new BYTE[levelW * levelH];
+  assert(bound != nullptr);
+  findBorder(labels, bound, levelW, levelH);
+
+  // interpolate the coarse solution and keep the boundary conditions
+  float* level = new float[levelW * levelH];
+  assert(level != nullptr);
+  scaleUp(labels, level, coarse, levelW, levelH, coarseWidth, 2);
+  delete[] coarse;
+  delete[] labels;
+  for (int i = 0; i < levelW * levelH; i++) {
+    if (bound[i] == PX_BLACK || bound[i] == PX_WHITE) {
+      level[i] = labelValue(bound[i]);
+    }
+  }
+
+  // smooth out the interpolation error
+  Worklist list;
+  buildWorklist(list, level, nullptr, bound, levelW, levelH);
+  std::vector<char> active(list.pos.size(), 1);
+  for (int i = 0; i < PYRAMID_SWEEPS; i++) {
+    if (!sweepActive(list, active, level)) break;
+  }
+  delete[] bound;
+
+  coarseWidth = levelW;
+  coarseHeight = levelH;
+  return level;
+}
+
 std::string ShapeFill::settingsContent() {
   return "v. 230112\n\
 manipulationMode draw\n\
@@ -306,257 +904,296 @@ std::string ShapeFill::layersContent(int n) {
   return ret;
 }
 
-void ShapeFill::boldBorder(Image<float>& im, std::string& number) {
-  Image<BYTE> imOrg(im.width(), im.height());
-  // set default values
-  for (int i = 0; i < im.width() * im.height(); i++) imOrg.data()[i] = 255;
-  // run the boldering phase
+Image<BYTE> ShapeFill::boldBorder(const Image<BYTE>& im,
+                                  const vec2<int>& minCoord, int width,
+                                  int height) {
+#ifdef TIME_MEASURE
+  auto start = std::chrono::high_resolution_clock::now();
+#endif  // TIME_MEASURE
+  Image<BYTE> imOrg(width, height);
+  // set default values, only the window and its margin are overwritten
+  memset(imOrg.data(), 255, (size_t)width * height);
+
+  // window with the margin the borders spread to
+  int x0 = std::max(minCoord.x - 1, 0), y0 = std::max(minCoord.y - 1, 0);
+  int x1 = std::min(minCoord.x + im.width(), width - 1);
+  int y1 = std::min(minCoord.y + im.height(), height - 1);
+  int bw = x1 - x0 + 1, bh = y1 - y0 + 1;
+  std::vector<BYTE> window((size_t)bw * bh, 255);
+  BYTE* origin = window.data() + (minCoord.x - x0) + (minCoord.y - y0) * bw;
   for (int h = 0; h < im.height(); h++) {
-    for (int w = 0; w < im.width(); w++) {
-      if (im(w, h) != 1.0f) {
-        // imOrg(w, h) = im(w, h) == 0.0f ? 0 : 64;
-        for (int i = -1; i <= 1; i++) {
-          if (h + i < 0 || h + i > im.height() - 1) continue;
-          for (int j = -1; j <= 1; j++) {
-            if (w + j < 0 || w + j > im.width() - 1) continue;
-            imOrg(w + j, h + i) = im(w, h) == 0.0f ? 0 : 64;
+    memcpy(origin + (size_t)h * bw, im.data() + (size_t)h * im.width(),
+           im.width());
+  }
+
+  // run the boldering phase on the bit mask of the borders, the covered
+  // pixels take the value of the border written last by the scatter of the
+  // borders in the row order, i.e. the lowest and then the rightmost one
+  int words = Morphology::rowWords(bw);
+  std::vector<uint64_t> border((size_t)words * bh);
+  Morphology::pack(window.data(), border.data(), bw, bh, 255);
+  Morphology::dilateBits(border.data(), bw, bh, 1);
+  for (int h = 0; h < bh; h++) {
+    const uint64_t* row = border.data() + (size_t)h * words;
+    for (int w = 0; w < bw; w++) {
+      if (!(row[w >> 6] & ((uint64_t)1 << (w & 63)))) continue;
+      int iEnd = std::max(h - 1, 0), jEnd = std::max(w - 1, 0);
+      BYTE value = 255;
+      for (int i = std::min(h + 1, bh - 1); i >= iEnd && value == 255; i--) {
+        const BYTE* src = window.data() + (size_t)i * bw;
+        for (int j = std::min(w + 1, bw - 1); j >= jEnd; j--) {
+          if (src[j] != 255) {
+            value = src[j];
+            break;
           }
         }
       }
+      imOrg(x0 + w, y0 + h) = value;
     }
   }
 
-  int len;
-  unsigned char* data = memFile(imOrg, &len);
-
-  zip_t* zip = zip_open(MM_PROJECT, ZIP_DEFAULT_COMPRESSION_LEVEL, 'a');
-  zip_entry_open(zip, std::string("_org_" + number + ".png").c_str());
-  zip_entry_write(zip, data, len);
-  zip_entry_close(zip);
-  zip_close(zip);
+#ifdef TIME_MEASURE
+  // the cost is linear in the window size, the time per pixel is constant
+  auto end = std::chrono::high_resolution_clock::now();
+  float us = std::chrono::duration<float, std::micro>(end - start).count();
+  std::stringstream ss;
+  ss << "Bold border of " << bw * bh << " pixels is " << us << " us ("
+     << 1000.0f * us / (bw * bh) << " ns per pixel)" << std::endl;
+  std::cout << ss.str();
+#endif  // TIME_MEASURE
 
-  free(data);
+  return imOrg;
 }
 
-void ShapeFill::setBoundary(float* estimate, float* orig, BYTE* block,
-                            const ColorMap& c_map, const Depth& depth,
-                            int width, int height, const vec2<int>& minCoord,
-                            BYTE num, BYTE seg) {
+void ShapeFill::setBoundary(const BYTE* estimate, const BYTE* orig,
+                            BYTE* block, const ColorMap& c_map,
+                            const Depth& depth, int width, int height,
+                            const vec2<int>& minCoord, BYTE num, BYTE seg) {
   std::stringstream ss;
   ss << std::setw(3) << std::setfill('0') << (int)num;
   std::string number = ss.str();
 
-  Image<float> im(c_map.getWidth(), c_map.getHeight());
-
-  for (int h = 0; h < im.height(); h++) {
-    int eh = h - minCoord.y;
-    for (int w = 0; w < im.width(); w++) {
-      int ew = w - minCoord.x;
-      // out of bounds or background pixels are marked white
-      if (ew < 0 || eh < 0 || ew >= width || eh >= height ||
-          estimate[ew + eh * width] == 0.0f) {
-        im(w, h) = 0.0f;
-        continue;
+  // The estimate is released before the queued images are rendered, the
+  // rendering works with its copy.
+  std::shared_ptr<std::vector<BYTE>> est =
+      std::make_shared<std::vector<BYTE>>(estimate, estimate + width * height);
+  vec2<int> minC = minCoord;
+
+  ProjectExport::Producer segLayer = [this, est, width, height, minC,
+                                     &c_map](int* len) {
+    const BYTE* estimate = est->data();
+    const vec2<int>& minCoord = minC;
+    Image<BYTE> im(c_map.getWidth(), c_map.getHeight());
+    // out of bounds pixels are marked black
+    memset(im.data(), 0, (size_t)im.width() * im.height());
+
+    for (int eh = 0; eh < height; eh++) {
+      for (int ew = 0; ew < width; ew++) {
+        // background pixels are black as well
+        im(ew + minCoord.x, eh + minCoord.y) =
+            estimate[ew + eh * width] == PX_BLACK ? 0 : 255;
       }
-      im(w, h) = 1.0f;
     }
-  }
-  int len;
-  unsigned char* data = memFile(im, &len);
-
-  zip_t* zip = zip_open(MM_PROJECT, ZIP_DEFAULT_COMPRESSION_LEVEL, 'a');
-  zip_entry_open(zip, std::string("_seg_" + number + ".png").c_str());
-  zip_entry_write(zip, data, len);
-  zip_entry_close(zip);
-  zip_close(zip);
-  free(data);
-
-  for (int h = 0; h < im.height(); h++) {
-    int eh = h - minCoord.y;
-    for (int w = 0; w < im.width(); w++) {
-      int ew = w - minCoord.x;
-      // out of bounds or background pixels are marked to be out of the segment
-      if (ew < 0 || eh < 0 || ew >= width || eh >= height ||
-          estimate[ew + eh * width] == 0.0f) {
-        im(w, h) = 1.0f;
-        continue;
-      }
-
-      // coordinates in the estimated image of the pixel surroundings
-      int dU = eh - 1, dD = eh + 1, dL = ew - 1, dR = ew + 1;
-
-      // pixels at the border between the white and black pixels
-      // or those that are at the border of the estimated area
-      // are to be marked black or grey
-      if (ew == 0 || eh == 0 || ew == width - 1 || eh == height - 1 ||
-          (dU >= 0 && estimate[ew + dU * width] == 0.0f) ||
-          (dL >= 0 && estimate[dL + eh * width] == 0.0f) ||
-          (dR < width && estimate[dR + eh * width] == 0.0f) ||
-          (dD < height && estimate[ew + dD * width] == 0.0f)) {
-        if (block[w + h * c_map.getWidth()] == 1) {
-          im(w, h) = 0.0f;
+    return memFile(im, len);
+  };
+  addLayer("_seg_" + number + ".png", layers[seg].seg, segLayer);
+
+  ProjectExport::Producer orgLayer = [this, est, orig, block, width, height,
+                                     minC, seg, &c_map, &depth](int* len) {
+    const BYTE* estimate = est->data();
+    const vec2<int>& minCoord = minC;
+    // pixels out of the window are out of the segment, only the window is
+    // rendered
+    Image<BYTE> im(width, height);
+    for (int eh = 0; eh < height; eh++) {
+      int h = eh + minCoord.y;
+      for (int ew = 0; ew < width; ew++) {
+        int w = ew + minCoord.x;
+        // background pixels are marked to be out of the segment
+        if (estimate[ew + eh * width] == PX_BLACK) {
+          im(ew, eh) = 255;
           continue;
         }
-        // neighborhood in the whole image
-        int oDU = h - 1, oDD = h + 1, oDL = w - 1, oDR = w + 1;
 
-        // check boundary
-        if (oDU < 0 || oDL < 0 || oDR >= c_map.getWidth() ||
-            oDD >= c_map.getHeight()) {
-          im(w, h) = 0.0f;
-          continue;
-        }
-
-        // force merge only in areas that are not connected to the background
-        if (block[w + h * c_map.getWidth()] == 2 &&
-            c_map.getMaskAt(w, oDU) != 0 && c_map.getMaskAt(oDL, h) != 0 &&
-            c_map.getMaskAt(oDR, h) != 0 && c_map.getMaskAt(w, oDD) != 0) {
-          im(w, h) = 0.25f;
-          continue;
-        }
-
-        // Smoothe out error made in the segmenting step, where the segment
-        // boundary misses the image boundaries. Search the sourrounding pixels
-        // for the lower intensities and set new boundary if necessary.
-        if (c_map.getMaskAt(w, h) == seg &&
-            (orig[w + oDU * c_map.getWidth()] < ORIG_WHITE_ERR ||
-             orig[w + oDD * c_map.getWidth()] < ORIG_WHITE_ERR ||
-             orig[oDL + h * c_map.getWidth()] < ORIG_WHITE_ERR ||
-             orig[oDR + h * c_map.getWidth()] < ORIG_WHITE_ERR)) {
-          im(w, h) = 0.0f;
-          continue;
-        }
-
-        // ----- MERGE -----
-
-        // merging boundaries are only with neighbouring segment that is not
-        // background and does not belong to the image boundary
-        if (c_map.getMaskAt(w, oDU) != 0 && c_map.getMaskAt(oDL, h) != 0 &&
-            c_map.getMaskAt(oDR, h) != 0 && c_map.getMaskAt(w, oDD) != 0) {
-          BYTE arrType = 0;
-          // Look at the neighbouring segments. They form a set of indices.
-          std::set<short> neighs;
-          neighs.insert(c_map.getMaskAt(w, oDU));
-          neighs.insert(c_map.getMaskAt(w, oDD));
-          neighs.insert(c_map.getMaskAt(oDL, h));
-          neighs.insert(c_map.getMaskAt(oDR, h));
-          neighs.erase(seg);
-          // Look through all arrows from current segment and compare all their
-          // types. There are three solution, there is red arrow, green arrow or
-          // none.
-          for (std::list<TopologicalSorting::Edge>::iterator it =
-                   depth.nodes[seg]->edgesOut.begin();
-               it != depth.nodes[seg]->edgesOut.end(); it++) {
-            BYTE to = (*it).to;
-            if (neighs.find(to) != neighs.end()) {
-              arrType = std::max(arrType, (BYTE)((*it).type + 1));
-            }
-          }
-          // Default is no arrow (0), arrow that supports merge (1) is green,
-          // arrow that denies merge is red (2). Default uses heuristics further
-          // in the code, the other two have immediate results. This is expected
-          // in situations where current segment is overlapped by another.
-          if (arrType == 2) {
-            im(w, h) = 0.0f;
+        // coordinates in the estimated image of the pixel surroundings
+        int dU = eh - 1, dD = eh + 1, dL = ew - 1, dR = ew + 1;
+
+        // pixels at the border between the white and black pixels
+        // or those that are at the border of the estimated area
+        // are to be marked black or grey
+        if (ew == 0 || eh == 0 || ew == width - 1 || eh == height - 1 ||
+            (dU >= 0 && estimate[ew + dU * width] == PX_BLACK) ||
+            (dL >= 0 && estimate[dL + eh * width] == PX_BLACK) ||
+            (dR < width && estimate[dR + eh * width] == PX_BLACK) ||
+            (dD < height && estimate[ew + dD * width] == PX_BLACK)) {
+          if (block[w + h * c_map.getWidth()] == 1) {
+            im(ew, eh) = 0;
             continue;
           }
-          if (arrType == 1) {
-            im(w, h) = 0.25f;
+          // neighborhood in the whole image
+          int oDU = h - 1, oDD = h + 1, oDL = w - 1, oDR = w + 1;
+
+          // check boundary
+          if (oDU < 0 || oDL < 0 || oDR >= c_map.getWidth() ||
+              oDD >= c_map.getHeight()) {
+            im(ew, eh) = 0;
             continue;
           }
 
-          // The current segment is overlapped by another one in this
-          // coordinate. We merge when the difference in depth level is equal
-          // to 1. The hole in the colour can have slightly darker colour than
-          // white, so a small error is accounted for.
-          if (depth.nodes[c_map.getMaskAt(w, oDU)]->depth -
-                      depth.nodes[seg]->depth ==
-                  1 ||
-              depth.nodes[c_map.getMaskAt(oDL, h)]->depth -
-                      depth.nodes[seg]->depth ==
-                  1 ||
-              depth.nodes[c_map.getMaskAt(oDR, h)]->depth -
-                      depth.nodes[seg]->depth ==
-                  1 ||
-              depth.nodes[c_map.getMaskAt(w, oDD)]->depth -
-                      depth.nodes[seg]->depth ==
-                  1) {
-            im(w, h) = 0.25f;
+          // force merge only in areas that are not connected to the background
+          if (block[w + h * c_map.getWidth()] == 2 &&
+              c_map.getMaskAt(w, oDU) != 0 && c_map.getMaskAt(oDL, h) != 0 &&
+              c_map.getMaskAt(oDR, h) != 0 && c_map.getMaskAt(w, oDD) != 0) {
+            im(ew, eh) = 64;
             continue;
           }
 
-          // ----- OPENED CONTOUR -----
-
-          // We expect the neighboring segments to be overlapped by the current
-          // one and there is an opened contour in the image.
-          if (orig[w + h * c_map.getWidth()] >= ORIG_WHITE_ERR &&
-              c_map.getMaskAt(w, h) == seg &&
-              (depth.nodes[c_map.getMaskAt(w, oDU)]->depth <
-                   depth.nodes[seg]->depth ||
-               depth.nodes[c_map.getMaskAt(oDL, h)]->depth <
-                   depth.nodes[seg]->depth ||
-               depth.nodes[c_map.getMaskAt(oDR, h)]->depth <
-                   depth.nodes[seg]->depth ||
-               depth.nodes[c_map.getMaskAt(w, oDD)]->depth <
-                   depth.nodes[seg]->depth)) {
-            im(w, h) = 0.25f;
+          // Smoothe out error made in the segmenting step, where the segment
+          // boundary misses the image boundaries. Search the sourrounding
+          // pixels for the lower intensities and set new boundary if necessary.
+          if (c_map.getMaskAt(w, h) == seg &&
+              (orig[w + oDU * c_map.getWidth()] == 0 ||
+               orig[w + oDD * c_map.getWidth()] == 0 ||
+               orig[oDL + h * c_map.getWidth()] == 0 ||
+               orig[oDR + h * c_map.getWidth()] == 0)) {
+            im(ew, eh) = 0;
             continue;
           }
-        }
 
-        im(w, h) = 0.0f;
-        continue;
+          // ----- MERGE -----
+
+          // merging boundaries are only with neighbouring segment that is not
+          // background and does not belong to the image boundary
+          if (c_map.getMaskAt(w, oDU) != 0 && c_map.getMaskAt(oDL, h) != 0 &&
+              c_map.getMaskAt(oDR, h) != 0 && c_map.getMaskAt(w, oDD) != 0) {
+            BYTE arrType = 0;
+            // Look at the neighbouring segments. They form a set of indices.
+            std::set<short> neighs;
+            neighs.insert(c_map.getMaskAt(w, oDU));
+            neighs.insert(c_map.getMaskAt(w, oDD));
+            neighs.insert(c_map.getMaskAt(oDL, h));
+            neighs.insert(c_map.getMaskAt(oDR, h));
+            neighs.erase(seg);
+            // Look through all arrows from current segment and compare all
+            // their types. There are three solution, there is red arrow, green
+            // arrow or none.
+            for (std::list<TopologicalSorting::Edge>::iterator it =
+                     depth.nodes[seg]->edgesOut.begin();
+                 it != depth.nodes[seg]->edgesOut.end(); it++) {
+              BYTE to = (*it).to;
+              if (neighs.find(to) != neighs.end()) {
+                arrType = std::max(arrType, (BYTE)((*it).type + 1));
+              }
+            }
+            // Default is no arrow (0), arrow that supports merge (1) is green,
+            // arrow that denies merge is red (2). Default uses heuristics
+            // further in the code, the other two have immediate results. This
+            // is expected in situations where current segment is overlapped by
+            // another.
+            if (arrType == 2) {
+              im(ew, eh) = 0;
+              continue;
+            }
+            if (arrType == 1) {
+              im(ew, eh) = 64;
+              continue;
+            }
+
+            // The current segment is overlapped by another one in this
+            // coordinate. We merge when the difference in depth level is equal
+            // to 1. The hole in the colour can have slightly darker colour than
+            // white, so a small error is accounted for.
+            if (depth.nodes[c_map.getMaskAt(w, oDU)]->depth -
+                        depth.nodes[seg]->depth ==
+                    1 ||
+                depth.nodes[c_map.getMaskAt(oDL, h)]->depth -
+                        depth.nodes[seg]->depth ==
+                    1 ||
+                depth.nodes[c_map.getMaskAt(oDR, h)]->depth -
+                        depth.nodes[seg]->depth ==
+                    1 ||
+                depth.nodes[c_map.getMaskAt(w, oDD)]->depth -
+                        depth.nodes[seg]->depth ==
+                    1) {
+              im(ew, eh) = 64;
+              continue;
+            }
+
+            // ----- OPENED CONTOUR -----
+
+            // We expect the neighboring segments to be overlapped by the
+            // current one and there is an opened contour in the image.
+            if (orig[w + h * c_map.getWidth()] != 0 &&
+                c_map.getMaskAt(w, h) == seg &&
+                (depth.nodes[c_map.getMaskAt(w, oDU)]->depth <
+                     depth.nodes[seg]->depth ||
+                 depth.nodes[c_map.getMaskAt(oDL, h)]->depth <
+                     depth.nodes[seg]->depth ||
+                 depth.nodes[c_map.getMaskAt(oDR, h)]->depth <
+                     depth.nodes[seg]->depth ||
+                 depth.nodes[c_map.getMaskAt(w, oDD)]->depth <
+                     depth.nodes[seg]->depth)) {
+              im(ew, eh) = 64;
+              continue;
+            }
+          }
+
+          im(ew, eh) = 0;
+          continue;
+        }
+        // inside of the foreground area is marked white
+        im(ew, eh) = 255;
       }
-      // inside of the foreground area is marked white
-      im(w, h) = 1.0f;
     }
-  }
-
-  boldBorder(im, number);
+    return memFile(boldBorder(im, minCoord, c_map.getWidth(),
+                                 c_map.getHeight()),
+                      len);
+  };
+  addLayer("_org_" + number + ".png", layers[seg].org, orgLayer);
 }
 
-void ShapeFill::findBorder(float* src, float* dst, int width, int height,
+void ShapeFill::findBorder(const BYTE* src, BYTE* dst, int width, int height,
                            int* ids, int* n) {
   for (int h = 0; h < height; h++) {
     for (int w = 0; w < width; w++) {
       int idx = w + h * width;
       // set default as an empty space
-      dst[idx] = -1.0f;
+      dst[idx] = PX_EMPTY;
       if (ids) ids[idx] = -1;
-      if (src[idx] == 0.0f) {  // if there is closer segment
-        dst[idx] = 0.5f;       // set the pixel as unknown by default
+      if (src[idx] == PX_BLACK) {  // if there is closer segment
+        dst[idx] = PX_GREY;        // set the pixel as unknown by default
         // then check for all neighbours
         if (h > 0) {
           if (src[idx - width] ==
-              0.5f)           // whether they are bordering the background
-            dst[idx] = 0.0f;  //   then set the output at position to 0
-          if (src[idx - width] == 1.0f) {  // or currently estimated segment
-            dst[idx] = 1.0f;  //  and set the output at position to 1
+              PX_GREY)            // whether they are bordering the background
+            dst[idx] = PX_BLACK;  //   then set the output at position to 0
+          if (src[idx - width] == PX_WHITE) {  // or currently estimated segment
+            dst[idx] = PX_WHITE;  //  and set the output at position to 1
             continue;
           }
         }
         if (w > 0) {
-          if (src[idx - 1] == 0.5f) dst[idx] = 0.0f;
-          if (src[idx - 1] == 1.0f) {
-            dst[idx] = 1.0f;
+          if (src[idx - 1] == PX_GREY) dst[idx] = PX_BLACK;
+          if (src[idx - 1] == PX_WHITE) {
+            dst[idx] = PX_WHITE;
             continue;
           }
         }
         if (h < height - 1) {
-          if (src[idx + width] == 0.5f) dst[idx] = 0.0f;
-          if (src[idx + width] == 1.0f) {
-            dst[idx] = 1.0f;
+          if (src[idx + width] == PX_GREY) dst[idx] = PX_BLACK;
+          if (src[idx + width] == PX_WHITE) {
+            dst[idx] = PX_WHITE;
             continue;
           }
         }
         if (w < width - 1) {
-          if (src[idx + 1] == 0.5f) dst[idx] = 0.0f;
-          if (src[idx + 1] == 1.0f) {
-            dst[idx] = 1.0f;
+          if (src[idx + 1] == PX_GREY) dst[idx] = PX_BLACK;
+          if (src[idx + 1] == PX_WHITE) {
+            dst[idx] = PX_WHITE;
             continue;
           }
         }
-        if (dst[idx] == 0.5f &&
+        if (dst[idx] == PX_GREY &&
             n != nullptr) {  // the unknown pixels will be estimated later
           ids[idx] = *n;     // save their index and
           *n += 1;           // increase their count
@@ -566,8 +1203,8 @@ void ShapeFill::findBorder(float* src, float* dst, int width, int height,
   }
 }
 
-void ShapeFill::treshold(const ColorMap& c_map, float* img, int width,
-                         int height, const vec2<int>& coord,
+void ShapeFill::treshold(const ColorMap& c_map, const float* img, BYTE* out,
+                         int width, int height, const vec2<int>& coord,
                          const std::set<short>& incidences, BYTE seg) {
   for (int h = 0; h < height; h++) {
     for (int w = 0; w < width; w++) {
@@ -578,86 +1215,228 @@ void ShapeFill::treshold(const ColorMap& c_map, float* img, int width,
       // to belong to it.
       if (neigh == seg || (img[w + h * width] >= 0.5f &&
                            incidences.find(neigh) != incidences.end())) {
-        img[idx] = 1.0f;
+        out[idx] = PX_WHITE;
         continue;
       }
-      img[idx] = 0.0f;
+      out[idx] = PX_BLACK;
     }
   }
 }
 
-void ShapeFill::saveByBorders(char* borders, BYTE* block, BYTE seg, float* orig,
-                              const ColorMap& c_map,
+void ShapeFill::saveByBorders(char* borders, BYTE* block, BYTE seg,
+                              const BYTE* orig, const ColorMap& c_map,
+                              std::vector<vec2<int>>& minCs,
+                              std::vector<vec2<int>>& maxCs,
                               std::vector<std::set<short>>& incidences,
                               int& number) {
   std::stringstream ss;
   ss << std::setw(3) << std::setfill('0') << number;
   std::string num = ss.str();
 
-  Image<float> im(c_map.getWidth(), c_map.getHeight());
-
-  for (int h = 0; h < im.height(); h++) {
-    for (int w = 0; w < im.width(); w++) {
-      // out of bounds or background pixels are marked white
-      im(w, h) = c_map.getMaskAt(w, h) == seg ? 1.0f : 0.0f;
+  // the segment lies in its window, the rest of the layers is constant
+  vec2<int> minC = minCs[seg], maxC = maxCs[seg];
+  ProjectExport::Producer segLayer = [seg, minC, maxC, &c_map](int* len) {
+    Image<BYTE> im(c_map.getWidth(), c_map.getHeight());
+    memset(im.data(), 0, (size_t)im.width() * im.height());
+
+    for (int h = minC.y; h <= maxC.y; h++) {
+      for (int w = minC.x; w <= maxC.x; w++) {
+        // out of bounds or background pixels are marked black
+        if (c_map.getMaskAt(w, h) == seg) im(w, h) = 255;
+      }
     }
-  }
-  int len;
-  unsigned char* data = memFile(im, &len);
-
-  zip_t* zip = zip_open(MM_PROJECT, ZIP_DEFAULT_COMPRESSION_LEVEL, 'a');
-  zip_entry_open(zip, std::string("_seg_" + num + ".png").c_str());
-  zip_entry_write(zip, data, len);
-  zip_entry_close(zip);
-  zip_close(zip);
-  free(data);
-
-  for (int h = 0; h < c_map.getHeight(); h++) {
-    for (int w = 0; w < c_map.getWidth(); w++) {
-      if (borders[w + h * c_map.getWidth()] == 1 &&
-          c_map.getMaskAt(w, h) == seg) {
-        int dU = h - 1, dD = h + 1, dL = w - 1, dR = w + 1;
-        // hitting image boundary or selected areas
-        if (dU < 0 || dL < 0 || dD >= c_map.getHeight() ||
-            dR >= c_map.getWidth() || block[w + h * c_map.getWidth()] == 1) {
-          im(w, h) = 0.0f;
-          continue;
-        }
-        // Do not connect to the background (id 0)
-        if (c_map.getMaskAt(w, dU) != 0 && c_map.getMaskAt(w, dD) != 0 &&
-            c_map.getMaskAt(dL, h) != 0 && c_map.getMaskAt(dR, h) != 0) {
-          // force the merge
-          if (block[w + h * c_map.getWidth()] == 2 ||
-              // or detect mergable area
-              (orig[w + h * c_map.getWidth()] >= ORIG_WHITE_ERR &&
-               // smoothe out errors from segmentation process
-               // segmentation can set the segment next to the drawn boundary
-               orig[dL + h * c_map.getWidth()] >= ORIG_WHITE_ERR &&
-               orig[dR + h * c_map.getWidth()] >= ORIG_WHITE_ERR &&
-               orig[w + dU * c_map.getWidth()] >= ORIG_WHITE_ERR &&
-               orig[w + dD * c_map.getWidth()] >= ORIG_WHITE_ERR)) {
-            im(w, h) = 0.25f;
+    return memFile(im, len);
+  };
+  addLayer("_seg_" + num + ".png", layers[seg].seg, segLayer);
+
+  ProjectExport::Producer orgLayer = [this, borders, block, seg, orig, minC,
+                                     maxC, &c_map](int* len) {
+    Image<BYTE> im(maxC.x - minC.x + 1, maxC.y - minC.y + 1);
+    for (int h = minC.y; h <= maxC.y; h++) {
+      for (int w = minC.x; w <= maxC.x; w++) {
+        if (borders[w + h * c_map.getWidth()] == 1 &&
+            c_map.getMaskAt(w, h) == seg) {
+          int dU = h - 1, dD = h + 1, dL = w - 1, dR = w + 1;
+          // hitting image boundary or selected areas
+          if (dU < 0 || dL < 0 || dD >= c_map.getHeight() ||
+              dR >= c_map.getWidth() || block[w + h * c_map.getWidth()] == 1) {
+            im(w - minC.x, h - minC.y) = 0;
             continue;
           }
-        }
+          // Do not connect to the background (id 0)
+          if (c_map.getMaskAt(w, dU) != 0 && c_map.getMaskAt(w, dD) != 0 &&
+              c_map.getMaskAt(dL, h) != 0 && c_map.getMaskAt(dR, h) != 0) {
+            // force the merge
+            if (block[w + h * c_map.getWidth()] == 2 ||
+                // or detect mergable area
+                (orig[w + h * c_map.getWidth()] != 0 &&
+                 // smoothe out errors from segmentation process
+                 // segmentation can set the segment next to the drawn boundary
+                 orig[dL + h * c_map.getWidth()] != 0 &&
+                 orig[dR + h * c_map.getWidth()] != 0 &&
+                 orig[w + dU * c_map.getWidth()] != 0 &&
+                 orig[w + dD * c_map.getWidth()] != 0)) {
+              im(w - minC.x, h - minC.y) = 64;
+              continue;
+            }
+          }
 
-        im(w, h) = 0.0f;
-        continue;
+          im(w - minC.x, h - minC.y) = 0;
+          continue;
+        }
+        im(w - minC.x, h - minC.y) = 255;
       }
-      im(w, h) = 1.0f;
     }
+    return memFile(
+        boldBorder(im, minC, c_map.getWidth(), c_map.getHeight()), len);
+  };
+  addLayer("_org_" + num + ".png", layers[seg].org, orgLayer);
+}
+
+/// <summary>
+/// Incremental 64-bit FNV-1a hash.
+/// </summary>
+struct Fingerprint {
+  uint64_t value = 14695981039346656037ull;
+
+  void add(const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+      value = (value ^ bytes[i]) * 1099511628211ull;
+    }
+  }
+
+  template <typename T>
+  void addValue(const T& v) {
+    add(&v, sizeof(T));
+  }
+};
+
+uint64_t ShapeFill::fingerprint(const ColorMap& c_map, const Depth& depth,
+                                const char* borders, const BYTE* block,
+                                const BYTE* orig, const vec2<int>& minC,
+                                const vec2<int>& maxC, BYTE seg,
+                                const std::set<short>& incidences) {
+  Fingerprint fp;
+  // settings of the estimation
+  fp.addValue(strength);
+  fp.addValue(scale);
+  fp.addValue(adaptiveScale);
+  fp.addValue(solver);
+  fp.addValue(pyramid);
+  fp.addValue(pcgRefine);
+  fp.addValue(pcgTolerance);
+  fp.addValue(chebyshev);
+  fp.addValue(maxIterations);
+  fp.addValue(timeBudget);
+
+  int width = c_map.getWidth(), height = c_map.getHeight();
+  fp.addValue(width);
+  fp.addValue(height);
+  fp.addValue(seg);
+  fp.addValue(minC);
+  fp.addValue(maxC);
+  fp.addValue(incidences.size());
+  for (short s : incidences) fp.addValue(s);
+
+  // the layers look one pixel out of the window
+  int x0 = std::max(minC.x - 1, 0), y0 = std::max(minC.y - 1, 0);
+  int x1 = std::min(maxC.x + 1, width - 1);
+  int y1 = std::min(maxC.y + 1, height - 1);
+  std::set<short> present;
+  for (int h = y0; h <= y1; h++) {
+    size_t row = (size_t)h * width + x0, len = x1 - x0 + 1;
+    for (int w = x0; w <= x1; w++) {
+      short mask = c_map.getMaskAt(w, h);
+      fp.addValue(mask);
+      present.insert(mask);
+    }
+    fp.add(borders + row, len);
+    fp.add(block + row, len);
+    fp.add(orig + row, len);
+  }
+
+  // merging depends on the depths of the neighbours and the arrows
+  for (short s : present) {
+    TopologicalSorting::Node* node = depth.nodes[s];
+    fp.addValue(node != nullptr ? node->depth : -1);
+  }
+  if (depth.nodes[seg] != nullptr) {
+    for (const TopologicalSorting::Edge& e : depth.nodes[seg]->edgesOut) {
+      fp.addValue(e.to);
+      fp.addValue(e.type);
+    }
+  }
+  return fp.value;
+}
+
+/// <summary>
+/// Producer returning a copy of the stored data.
+/// </summary>
+/// <param name="data">Stored data</param>
+/// <returns>Producer of the entry data</returns>
+static ProjectExport::Producer copyProducer(
+    std::shared_ptr<std::vector<unsigned char>> data) {
+  return [data](int* len) {
+    unsigned char* ret = (unsigned char*)malloc(data->size());
+    if (ret) memcpy(ret, data->data(), data->size());
+    *len = (int)data->size();
+    return ret;
+  };
+}
+
+bool ShapeFill::reuseLayers(BYTE seg, uint64_t key, int number) {
+  std::map<BYTE, LayerCache>::iterator it = layers.find(seg);
+  if (it == layers.end() || it->second.fingerprint != key ||
+      it->second.seg == nullptr || it->second.seg->empty() ||
+      it->second.org == nullptr || it->second.org->empty()) {
+    return false;
   }
-  boldBorder(im, num);
+  std::stringstream ss;
+  ss << std::setw(3) << std::setfill('0') << number;
+  std::string num = ss.str();
+
+  // the PNG data do not depend on the layer number
+  project.add("_seg_" + num + ".png", copyProducer(it->second.seg));
+  project.add("_org_" + num + ".png", copyProducer(it->second.org));
+  if (it->second.solved) stats[seg] = it->second.stats;
+  return true;
+}
+
+void ShapeFill::addLayer(const std::string& name,
+                         std::shared_ptr<std::vector<unsigned char>> store,
+                         ProjectExport::Producer producer) {
+  project.add(name, [store, producer](int* len) {
+    unsigned char* data = producer(len);
+    // read by the next export only, after this one is closed
+    if (data && store) store->assign(data, data + *len);
+    return data;
+  });
 }
 
 void ShapeFill::SFRun(const ColorMap& c_map, const Depth& depth, char* borders,
-                      BYTE* block, float* orig, std::vector<vec2<int>>& minCs,
+                      BYTE* block, const BYTE* orig,
+                      std::vector<vec2<int>>& minCs,
                       std::vector<vec2<int>>& maxCs, BYTE seg,
                       std::vector<std::set<short>>& incidences, int& number) {
   if (maxCs[seg].x == 0 && maxCs[seg].y == 0) return;
+  // Segments with unchanged inputs reuse the layers of the last export
+  uint64_t key = fingerprint(c_map, depth, borders, block, orig, minCs[seg],
+                             maxCs[seg], seg, incidences[seg]);
+  if (reuseLayers(seg, key, number)) {
+    number += 1;
+    return;
+  }
+  LayerCache& cached = layers[seg];
+  cached.fingerprint = key;
+  cached.solved = false;
+  cached.seg = std::make_shared<std::vector<unsigned char>>();
+  cached.org = std::make_shared<std::vector<unsigned char>>();
+
   // Segments without neighbours closer to the user are saved immediately
   if (incidences[seg].empty()) {
-    saveByBorders(borders, block, seg, orig, c_map, incidences, number);
+    saveByBorders(borders, block, seg, orig, c_map, minCs, maxCs, incidences,
+                  number);
     number += 1;
     return;
   }
@@ -666,34 +1445,33 @@ void ShapeFill::SFRun(const ColorMap& c_map, const Depth& depth, char* borders,
   // the c_map
   vec2<int> minC = minCs[seg], maxC = maxCs[seg];
   int width = maxC.x - minC.x + 1, height = maxC.y - minC.y + 1;
-  float* compImg = new float[width * height];
-  assert(compImg != nullptr);
+  // the masks are byte labels, floats are kept for the solved values
+  BYTE* compMask = new BYTE[width * height];
+  assert(compMask != nullptr);
 
   // mark segments and prepare them to scaling down
   for (int h = minC.y, i = 0; h <= maxC.y; h++, i++) {
     for (int w = minC.x, j = 0; w <= maxC.x; w++, j++) {
       // Current segment white
       if (c_map.getMaskAt(w, h) == seg) {
-        compImg[j + i * width] = 1.0f;
+        compMask[j + i * width] = PX_WHITE;
         continue;
       }
       // Its neighbours black
       if (incidences[seg].find(c_map.getMaskAt(w, h)) !=
           incidences[seg].end()) {
-        compImg[j + i * width] = 0.0f;
+        compMask[j + i * width] = PX_BLACK;
         continue;
       }
       // others grey
-      compImg[j + i * width] = 0.5f;
+      compMask[j + i * width] = PX_GREY;
     }
   }
-  //floatWrite(compImg, width, height, "pictures/_com_img_" +
-  //  std::to_string(seg) + ".png");
 
-  float* tmpBorder = new float[width * height];
+  BYTE* tmpBorder = new BYTE[width * height];
   assert(tmpBorder != nullptr);
   // find boundary conditions in the selection in normal size
-  findBorder(compImg, tmpBorder, width, height);
+  findBorder(compMask, tmpBorder, width, height);
 
 #ifdef TIME_MEASURE
   std::cout << "\n\nSEGMENT : " << (int)seg << std::endl;
@@ -702,43 +1480,109 @@ void ShapeFill::SFRun(const ColorMap& c_map, const Depth& depth, char* borders,
 
   int scaledW, scaledH;
   // Create scaled down version of the selected area
-  float* scaleieq = scaleDown(compImg, width, height, scaledW, scaledH);
-  float* toCompute = new float[width * height];
-  assert(toCompute != nullptr);
+  int factor = segmentScale(compMask, width, height);
+  BYTE* scaleieq =
+      scaleDown(compMask, width, height, scaledW, scaledH, factor);
+#ifdef TIME_MEASURE
+  std::cout << "Scaling factor " << factor << std::endl;
+#endif  // TIME_MEASURE
+  BYTE* scaledBorder = new BYTE[scaledW * scaledH];
+  assert(scaledBorder != nullptr);
   int* ids = new int[scaledW * scaledH];
   assert(ids != nullptr);
   int n = 0;
 
   // Find boundary conditions
-  findBorder(scaleieq, toCompute, scaledW, scaledH, ids, &n);
+  findBorder(scaleieq, scaledBorder, scaledW, scaledH, ids, &n);
   delete[] scaleieq;
+  float* toCompute = labelImage(scaledBorder, scaledW * scaledH);
+  delete[] scaledBorder;
   floatWrite(toCompute, scaledW, scaledH,
              "pictures/_com_sc_img_" + std::to_string(seg) + ".png");
 
+#ifdef TIME_MEASURE
+  // compare the selected backend with the sparse Cholesky factorization
+  {
+    float* cholesky = new float[scaledW * scaledH];
+    memcpy(cholesky, toCompute, scaledW * scaledH * sizeof(float));
+    auto cStart = std::chrono::high_resolution_clock::now();
+    Matrices::solve(cholesky, scaledW, scaledH, ids, n, CHOLESKY);
+    auto cEnd = std::chrono::high_resolution_clock::now();
+    std::cout << "Cholesky solve of " << n << " unknowns is "
+              << std::chrono::duration_cast<std::chrono::microseconds>(cEnd -
+                                                                       cStart)
+                     .count()
+              << " us" << std::endl;
+    delete[] cholesky;
+  }
+  auto mStart = std::chrono::high_resolution_clock::now();
+#endif  // TIME_MEASURE
+
   // Solve a linear system on the scaled down image to estimate the boundary
   // beneath closer segments
-  Matrices::solve(toCompute, scaledW, scaledH, ids, n);
+  SolverStats coarse =
+      Matrices::solve(toCompute, scaledW, scaledH, ids, n, solver);
+  if (!coarse.converged) {
+    std::cerr << "Segment " << (int)seg << ": linear solve stopped after "
+              << coarse.iterations << " iterations, residual "
+              << coarse.residual << std::endl;
+  }
+#ifdef TIME_MEASURE
+  auto mEnd = std::chrono::high_resolution_clock::now();
+  std::cout << "Coarse solve of " << n << " unknowns is "
+            << std::chrono::duration_cast<std::chrono::microseconds>(mEnd -
+                                                                     mStart)
+                   .count()
+            << " us, " << coarse.iterations << " iterations, residual "
+            << coarse.residual << (coarse.converged ? "" : ", not converged")
+            << std::endl;
+#endif  // TIME_MEASURE
   //floatWrite(toCompute, scaledW, scaledH,
   //           "pictures/_com_sc_img2_" + std::to_string(seg) + ".png");
   delete[] ids;
 
   // scale up the estimate
-  scaleUp(compImg, toCompute, width, height, scaledW);
+  while (pyramid && factor > 2) {
+    toCompute =
+        prolong(compMask, width, height, toCompute, scaledW, scaledH, factor);
+  }
+  float* compImg = new float[width * height];
+  assert(compImg != nullptr);
+  scaleUp(compMask, compImg, toCompute, width, height, scaledW, factor);
   delete[] toCompute;
 
-  // find distance transform of the boundaries
-  float* dists = dt(tmpBorder, width, height);
-  //visualizeDist(dists, width, height, seg);
-
   // apply boundary conditions to the scaled up estimate as they can be blurred
   for (int i = 0; i < width * height; i++) {
-    if (tmpBorder[i] == 0.0f || tmpBorder[i] == 1.0f) {
-      compImg[i] = tmpBorder[i];
+    if (tmpBorder[i] == PX_BLACK || tmpBorder[i] == PX_WHITE) {
+      compImg[i] = labelValue(tmpBorder[i]);
     }
   }
-  // smooth out the estimated data
-  GaussSeidelVar(compImg, dists, tmpBorder, width, height);
-  delete[] dists;
+#ifdef TIME_MEASURE
+  float* warm = new float[width * height];
+  memcpy(warm, compImg, width * height * sizeof(float));
+#endif  // TIME_MEASURE
+
+  if (pcgRefine) {
+    // converge to the solution of the full resolution system directly
+    float* border = labelImage(tmpBorder, width * height);
+    stats[seg] =
+        Matrices::refine(compImg, border, width, height, pcgTolerance);
+    delete[] border;
+#ifdef TIME_MEASURE
+    std::cout << "PCG iterations " << stats[seg].iterations << ", residual "
+              << stats[seg].residual << std::endl;
+#endif  // TIME_MEASURE
+  } else {
+    // find distance transform of the boundaries
+    float* dists = dt(tmpBorder, width, height, PX_GREY, PoolFor());
+    //visualizeDist(dists, width, height, seg);
+
+    // smooth out the estimated data
+    stats[seg] = GaussSeidelVarRB(compImg, dists, width, height);
+    delete[] dists;
+  }
+  cached.stats = stats[seg];
+  cached.solved = true;
 
 #ifdef TIME_MEASURE
   auto end = std::chrono::high_resolution_clock::now();
@@ -748,8 +1592,57 @@ void ShapeFill::SFRun(const ColorMap& c_map, const Depth& depth, char* borders,
   floatWrite(compImg, width, height,
             "pictures/_com_gs_img_" + std::to_string(seg) + ".png");
 
+  // lexicographic variable kernel from the same scaled up estimate
+  {
+    float* lex = new float[width * height];
+    memcpy(lex, warm, width * height * sizeof(float));
+    start = std::chrono::high_resolution_clock::now();
+    float* dists = dt(tmpBorder, width, height, PX_GREY, PoolFor());
+    GaussSeidelVar(lex, dists, tmpBorder, width, height);
+    end = std::chrono::high_resolution_clock::now();
+    dur = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    std::cout << "Time for segment " << (int)seg
+              << " with lexicographic VK is " << dur.count() << " us"
+              << std::endl;
+    delete[] dists;
+    delete[] lex;
+  }
+
+  // conjugate gradients from the same scaled up estimate
+  float* border = labelImage(tmpBorder, width * height);
+  start = std::chrono::high_resolution_clock::now();
+  SolverStats pcgStats =
+      Matrices::refine(warm, border, width, height, pcgTolerance);
+  end = std::chrono::high_resolution_clock::now();
+  dur = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+  std::cout << "Time for segment " << (int)seg << " with PCG is " << dur.count()
+            << " us, " << pcgStats.iterations << " iterations, residual "
+            << pcgStats.residual << std::endl;
+  floatWrite(warm, width, height,
+             "pictures/_com_pcg_img_" + std::to_string(seg) + ".png");
+  delete[] warm;
+
+  // full resolution Cholesky factorization as the reference
+  {
+    float* direct = new float[width * height];
+    int* fullIds = new int[width * height];
+    int fullN = 0;
+    memcpy(direct, border, width * height * sizeof(float));
+    for (int i = 0; i < width * height; i++) {
+      fullIds[i] = tmpBorder[i] == PX_GREY ? fullN++ : -1;
+    }
+    start = std::chrono::high_resolution_clock::now();
+    Matrices::solve(direct, width, height, fullIds, fullN, CHOLESKY);
+    end = std::chrono::high_resolution_clock::now();
+    dur = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    std::cout << "Time for segment " << (int)seg << " with Cholesky is "
+              << dur.count() << " us" << std::endl;
+    delete[] fullIds;
+    delete[] direct;
+  }
+
   float* space = new float[width * height];
-  memcpy(space, tmpBorder, width * height * sizeof(float));
+  memcpy(space, border, width * height * sizeof(float));
   // for gauss seidel iteration we can expect that most of the space will belong solely
   // to the overlapping segment, should the other occur, the algorithm should converge correctly 
   for (int i = 0; i < width * height; i++) {
@@ -762,34 +1655,37 @@ void ShapeFill::SFRun(const ColorMap& c_map, const Depth& depth, char* borders,
   dur = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
   std::cout << "Time for segment " << (int)seg << " with NK is " << dur.count()
             << " us" << std::endl;
-  floatWrite(tmpBorder, width, height,
+  floatWrite(border, width, height,
              "pictures/_GS_bor_seg" + std::to_string((int)seg) + ".png");
   floatWrite(space, width, height,
              "pictures/_GS_out_seg" + std::to_string((int)seg) + ".png");
   delete[] space;
+  delete[] border;
 #endif // TIME_MEASURE
 
 
   floatWrite(compImg, width, height,
              "pictures/_com_gs_img_" + std::to_string(seg) + ".png");
 
-  // trashold the estimate
-  treshold(c_map, compImg, width, height, minC, incidences[seg], seg);
+  // trashold the estimate, the selection labels are not needed anymore
+  treshold(c_map, compImg, compMask, width, height, minC, incidences[seg],
+           seg);
 
   // find the new boundary and save it
   vec2<int> size = {c_map.getWidth(), c_map.getHeight()};
-  setBoundary(compImg, orig, block, c_map, depth, width, height, minC, number,
+  setBoundary(compMask, orig, block, c_map, depth, width, height, minC, number,
               seg);
 
   number += 1;
   delete[] compImg;
+  delete[] compMask;
   delete[] tmpBorder;
 }
 
 void ShapeFill::handleNeighborhood(char* borders, int w, int h, int dW, int dH,
                         const Depth& depth, const ColorMap& c_map, BYTE seg,
                         bool* alone, bool* neighHigher, short* firstNeigh,
-                        float* im) {
+                        const BYTE* im) {
   borders[w + h * c_map.getWidth()] = 1;
   if (depth.nodes[seg]->depth < depth.nodes[c_map.getMaskAt(dW, dH)]->depth)
     neighHigher[seg] = true;
@@ -808,8 +1704,59 @@ void ShapeFill::handleNeighborhood(char* borders, int w, int h, int dW, int dH,
 }
 
 
-bool* ShapeFill::createBorders(char* borders, const Depth& depth, float* im,
-                               const ColorMap& c_map,
+/// <summary>
+/// Extends the window of the segment by the pixels of the closer segments
+/// reachable from its contact band through other closer pixels. The window
+/// gets a margin of one pixel, so their neighbourhood is complete.
+/// </summary>
+/// <param name="c_map">Color map containing data for each segment</param>
+/// <param name="seg">Segment ID</param>
+/// <param name="occluders">Closer segments</param>
+/// <param name="minC">Minimal coordinate of the window, updated</param>
+/// <param name="maxC">Maximal coordinate of the window, updated</param>
+/// <param name="visited">Last segment flooded through each pixel</param>
+static void floodOcclusion(const ColorMap& c_map, short seg,
+                           const std::set<short>& occluders, vec2<int>& minC,
+                           vec2<int>& maxC, std::vector<short>& visited) {
+  int width = c_map.getWidth(), height = c_map.getHeight();
+  bool closer[256] = {false};
+  for (short o : occluders) closer[o] = true;
+  std::vector<int> stack;
+  auto push = [&](int w, int h) {
+    int idx = w + h * width;
+    if (visited[idx] == seg || !closer[c_map.getMaskAt(w, h)]) return;
+    visited[idx] = seg;
+    stack.push_back(idx);
+  };
+
+  // seed the flood by the closer pixels touching the segment
+  vec2<int> from = minC, to = maxC;
+  for (int h = from.y; h <= to.y; h++) {
+    for (int w = from.x; w <= to.x; w++) {
+      if (c_map.getMaskAt(w, h) != seg) continue;
+      if (w > 0) push(w - 1, h);
+      if (w < width - 1) push(w + 1, h);
+      if (h > 0) push(w, h - 1);
+      if (h < height - 1) push(w, h + 1);
+    }
+  }
+
+  while (!stack.empty()) {
+    int w = stack.back() % width, h = stack.back() / width;
+    stack.pop_back();
+    minC = {std::max(std::min(minC.x, w - 1), 0),
+            std::max(std::min(minC.y, h - 1), 0)};
+    maxC = {std::min(std::max(maxC.x, w + 1), width - 1),
+            std::min(std::max(maxC.y, h + 1), height - 1)};
+    if (w > 0) push(w - 1, h);
+    if (w < width - 1) push(w + 1, h);
+    if (h > 0) push(w, h - 1);
+    if (h < height - 1) push(w, h + 1);
+  }
+}
+
+bool* ShapeFill::createBorders(char* borders, const Depth& depth,
+                               const BYTE* im, const ColorMap& c_map,
                                std::vector<vec2<int>>& minC,
                                std::vector<vec2<int>>& maxC,
                                std::vector<std::set<short>>& incidences,
@@ -889,22 +1836,12 @@ bool* ShapeFill::createBorders(char* borders, const Depth& depth, float* im,
     }
   }
 
-  // set the resolution of the selected areas to the size of the incident
-  // segments, as the segments could be hidden anywhere behind their neighbours
+  // extend the selected areas over the pixels of the closer segments, which
+  // are connected to the segment, as only they can hide its shape
+  std::vector<short> visited(c_map.getWidth() * c_map.getHeight(), -1);
   for (int i = 1; i < incidences.size(); i++) {
-    if (incidences[i].empty()) continue;
-    for (std::set<short>::iterator it = incidences[i].begin();
-         it != incidences[i].end(); it++) {
-      short neighbour = *it;
-
-      tmpMin[i].x = std::max(std::min(tmpMin[i].x, minC[neighbour].x - 1), 0);
-      tmpMin[i].y = std::max(std::min(tmpMin[i].y, minC[neighbour].y - 1), 0);
-
-      tmpMax[i].x = std::min(std::max(tmpMax[i].x, maxC[neighbour].x + 1),
-                             c_map.getWidth() - 1);
-      tmpMax[i].y = std::min(std::max(tmpMax[i].y, maxC[neighbour].y + 1),
-                             c_map.getHeight() - 1);
-    }
+    if (incidences[i].empty() || maxC[i].x < minC[i].x) continue;
+    floodOcclusion(c_map, i, incidences[i], tmpMin[i], tmpMax[i], visited);
   }
 
   minC = tmpMin;
@@ -915,17 +1852,18 @@ bool* ShapeFill::createBorders(char* borders, const Depth& depth, float* im,
   return alone;
 }
 
-Image<RGB> ShapeFill::templateData(const ColorMap& c_map,
-                                   std::string& filename) {
-  Image<float> im = imread<float>(FOLDER + filename);
-  Utils::scaleAndPad(im);
-  Utils::gammaCorrection(im);
-  Image<RGB> ret(im.width(), im.height());
+Image<RGBA8> ShapeFill::templateData(const ColorMap& c_map,
+                                     std::string& filename) {
+  std::shared_ptr<const Image<float>> im =
+      ImageCache::corrected(FOLDER + filename);
+  Image<RGBA8> ret(im->width(), im->height());
   // Original contains intensity, and color map contains color at pixel
-  // location.
-  for (int i = 0; i < c_map.getHeight() * c_map.getWidth(); i++) {
-    ret.data()[i] = im.data()[i] * c_map.getColorAt(i);
-  }
+  // location. Pixels without a segment take the first color.
+  std::vector<RGB> palette(1, RGB(DEFAULT_COLOR));
+  palette.insert(palette.end(), c_map.getColors().begin(),
+                 c_map.getColors().end());
+  ColorKernels::tint(im->data(), c_map.data(), palette.data(), ret.data(),
+                     (size_t)c_map.getWidth() * c_map.getHeight());
   return ret;
 }
 
@@ -933,30 +1871,18 @@ void ShapeFill::shapeFill(const Depth& depth, const ColorMap& c_map,
                           float* _orig, std::string& filename, BYTE* block,
                           std::string name) {
   if (depth.order.size() == 0) return;
-  float* orig = new float[c_map.getWidth() * c_map.getHeight()];
-  memcpy(orig, _orig, c_map.getWidth() * c_map.getHeight() * sizeof(float));
+  BYTE* orig = new BYTE[c_map.getWidth() * c_map.getHeight()];
   char* borders = new char[c_map.getWidth() * c_map.getHeight()];
   std::vector<vec2<int>> mins, maxs;
   std::vector<std::set<short>> incidences;
   mins.resize(256);
   maxs.resize(256);
   incidences.resize(256);
-  {
-    // Prepare zip file
-    FILE* f =
-        fopen(std::string(std::string(FOLDER) + "mm_project.zip").c_str(), "r");
-    if (f) {
-      fclose(f);
-      remove(std::string(std::string(FOLDER) + "mm_project.zip").c_str());
-    }
-    // Add settings file
-    std::string sc = settingsContent();
-    zip_t* zip = zip_open(MM_PROJECT, ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
-    zip_entry_open(zip, "settings.txt");
-    zip_entry_write(zip, sc.c_str(), sc.size());
-    zip_entry_close(zip);
-    zip_close(zip);
-  }
+  // Prepare zip file, the layers are rendered and compressed on worker
+  // threads while the following segments are being estimated
+  project.open(MM_PROJECT);
+  project.add("settings.txt", settingsContent());
+  stats.clear();
 
   // prepare borders, minimal and maximal coordinates of the segments
   for (int i = 0; i < 256; i++) {
@@ -966,8 +1892,8 @@ void ShapeFill::shapeFill(const Depth& depth, const ColorMap& c_map,
 
   /*Utils::blur(orig, c_map.getWidth(), c_map.getHeight());
   Utils::edgeDetect(orig, c_map.getWidth(), c_map.getHeight());*/
-  Utils::gammaCorrection(orig, c_map.getWidth(), c_map.getHeight());
-  Utils::blurAndTreshold(orig, c_map.getWidth(), c_map.getHeight());
+  Utils::gammaBlurAndTreshold(_orig, orig, c_map.getWidth(),
+                              c_map.getHeight());
 
   for (int i = 0; i < c_map.getWidth() * c_map.getHeight(); i++) borders[i] = 0;
   bool* separateSegs =
@@ -985,22 +1911,13 @@ void ShapeFill::shapeFill(const Depth& depth, const ColorMap& c_map,
   }
 
   // Save template data and layers data
-  Image<RGB> Template = templateData(c_map, filename);
-  int len;
-  unsigned char* td = memFile(Template, &len);
-  std::string lc = layersContent(number);
-
-  zip_t* zip = zip_open(MM_PROJECT, ZIP_DEFAULT_COMPRESSION_LEVEL, 'a');
-  zip_entry_open(zip, "layers.txt");
-  zip_entry_write(zip, lc.c_str(), lc.size());
-  zip_entry_close(zip);
-
-  zip_entry_open(zip, "template.png");
-  zip_entry_write(zip, td, len);
-  zip_entry_close(zip);
-  zip_close(zip);
-
-  free(td);
+  project.add("layers.txt", layersContent(number));
+  project.add("template.png", [this, &c_map, &filename](int* len) {
+    return memFile(templateData(c_map, filename), len);
+  });
+  // the queued layers reference the buffers below
+  project.close();
+
   delete[] separateSegs;
   delete[] borders;
   delete[] orig;
@@ -34,12 +34,15 @@
 #endif
 #endif  // _DEBUG
 
+#include <cstdint>
 #include <map>
+#include <memory>
 #include <set>
 
 #include "ColorMap.h"
 #include "Depth.h"
 #include "MatriceSolve.h"
+#include "ProjectExport.h"
 #include "defines.h"
 
 /// <summary>
@@ -48,7 +51,38 @@
 class ShapeFill {
  private:
   float strength;
+  // scaling factor used when it is not chosen by the segment size
   float scale;
+  // choose the scaling factor of each segment by its count of unknowns
+  bool adaptiveScale;
+  // backend solving the scaled down systems
+  LaplaceSolver solver;
+  // scale the coarse solution up through the intermediate levels
+  bool pyramid;
+  // replace the variable kernel iteration with conjugate gradients
+  bool pcgRefine;
+  float pcgTolerance;
+  // accelerate the unit kernel iterations by Chebyshev over-relaxation
+  bool chebyshev;
+  // budgets of the iterations of one segment, zero time is unlimited
+  int maxIterations;
+  float timeBudget;
+  // convergence of the last computed segments
+  std::map<BYTE, SolverStats> stats;
+  ProjectExport project;
+
+  /// <summary>
+  /// Layers of a segment exported by the previous shapeFill together with the
+  /// fingerprint of the inputs they were computed from.
+  /// </summary>
+  struct LayerCache {
+    uint64_t fingerprint = 0;
+    bool solved = false;  // stats are valid, the segment was estimated
+    SolverStats stats;
+    std::shared_ptr<std::vector<unsigned char>> seg;  // PNG of _seg_ layer
+    std::shared_ptr<std::vector<unsigned char>> org;  // PNG of _org_ layer
+  };
+  std::map<BYTE, LayerCache> layers;
 
  public:
   ShapeFill();
@@ -66,6 +100,43 @@ class ShapeFill {
   void shapeFill(const Depth& depth, const ColorMap& c_map, float* orig,
                  std::string& filename, BYTE* block, std::string name);
 
+  /// <summary>
+  /// Convergence statistics of the segments computed by the last shapeFill.
+  /// </summary>
+  /// <returns>Statistics by segment ID</returns>
+  const std::map<BYTE, SolverStats>& solverStats() const;
+
+  /// <summary>
+  /// Selects the backend solving the scaled down systems.
+  /// </summary>
+  /// <param name="backend">Linear system backend</param>
+  void setSolver(LaplaceSolver backend);
+
+  /// <summary>
+  /// Selects the refinement of the scaled up estimate on the full
+  /// resolution, the variable kernel iteration by default.
+  /// </summary>
+  /// <param name="pcg">Refine with preconditioned conjugate gradients</param>
+  /// <param name="tolerance">Relative residual norm the conjugate gradients
+  /// reach</param>
+  void setRefinement(bool pcg, float tolerance = PCG_TOLERANCE);
+
+  /// <summary>
+  /// Limits the variable kernel iteration of each segment. The iteration
+  /// stops on the first exhausted budget even when it has not converged.
+  /// </summary>
+  /// <param name="iterations">Maximal count of the iterations</param>
+  /// <param name="milliseconds">Time budget, zero is unlimited</param>
+  void setBudget(int iterations, float milliseconds = 0.0f);
+
+  /// <summary>
+  /// Scales the solution of the scaled down system up through the
+  /// intermediate levels, each of them smoothed by PYRAMID_SWEEPS sweeps,
+  /// instead of in one step. Off by default.
+  /// </summary>
+  /// <param name="enabled">Use the pyramid</param>
+  void setPyramid(bool enabled);
+
  private:
   /// <summary>
   /// Saves segment borders by the segment outline.
@@ -73,43 +144,81 @@ class ShapeFill {
   /// <param name="borders">Segment borders</param>
   /// <param name="block">Merge blocking selection</param>
   /// <param name="seg">Segment number</param>
-  /// <param name="orig">Original image</param>
+  /// <param name="orig">Mask of the white pixels</param>
   /// <param name="c_map">Color map</param>
+  /// <param name="minCs">Minimal coordinates of the segments</param>
+  /// <param name="maxCs">Maximal coordinates of the segments</param>
   /// <param name="incidences">Incident segments</param>
   /// <param name="number">Segment number for saving</param>
-  void saveByBorders(char* borders, BYTE* block, BYTE seg, float* orig,
-                     const ColorMap& c_map,
+  void saveByBorders(char* borders, BYTE* block, BYTE seg, const BYTE* orig,
+                     const ColorMap& c_map, std::vector<vec2<int>>& minCs,
+                     std::vector<vec2<int>>& maxCs,
                      std::vector<std::set<short>>& incidences, int& number);
 
   /// <summary>
-  /// Scales down image with binary segmentation data
+  /// Scales down labelled image with binary segmentation data
   /// </summary>
-  /// <param name="img">Image</param>
+  /// <param name="img">Pixel labels</param>
   /// <param name="width">Image width</param>
   /// <param name="height">Image height</param>
   /// <param name="newWidth">Output scaled down width</param>
   /// <param name="newHeight">Output scaled down height</param>
-  /// <returns>Scaled down image</returns>
-  float* scaleDown(float* img, int width, int height, int& newWidth,
-                   int& newHeight);
+  /// <param name="factor">Scaling factor</param>
+  /// <returns>Scaled down labels</returns>
+  BYTE* scaleDown(const BYTE* img, int width, int height, int& newWidth,
+                  int& newHeight, int factor);
 
   /// <summary>
-  /// Scales up grayscale image with bilinear interpolation
+  /// Scales up grayscale image with bilinear interpolation. Only the black
+  /// pixels are interpolated, the others are set empty (-1).
   /// </summary>
-  /// <param name="img">Image data</param>
+  /// <param name="img">Pixel labels</param>
+  /// <param name="out">Output image</param>
   /// <param name="scaled">Scaled down image</param>
   /// <param name="width">Image width</param>
   /// <param name="height">Image height</param>
   /// <param name="scaledWidth">Width of the scaled down image</param>
-  void scaleUp(float* img, float* scaled, int width, int height,
-               int scaledWidth);
+  /// <param name="factor">Scaling factor</param>
+  void scaleUp(const BYTE* img, float* out, const float* scaled, int width,
+               int height, int scaledWidth, int factor);
 
   /// <summary>
-  /// Makes selected border bolder and return file prepared to saving
+  /// Chooses the scaling factor of the segment, so the scaled down system
+  /// has about SCALE_UNKNOWNS unknowns. Small segments are not scaled.
   /// </summary>
-  /// <param name="im">Border image</param>
-  /// <param name="number">Segment number</param>
-  void boldBorder(Image<float>& im, std::string& number);
+  /// <param name="img">Labels with binary segmentation data</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  /// <returns>Power of two scaling factor</returns>
+  int segmentScale(const BYTE* img, int width, int height);
+
+  /// <summary>
+  /// Scales the solution up by one pyramid level, a half of the factor, and
+  /// smooths it there.
+  /// </summary>
+  /// <param name="img">Labels with binary segmentation data</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  /// <param name="coarse">Solution of the coarser level, deleted</param>
+  /// <param name="coarseWidth">Width of the level, updated</param>
+  /// <param name="coarseHeight">Height of the level, updated</param>
+  /// <param name="factor">Scaling factor of the level, updated</param>
+  /// <returns>Solution of the finer level</returns>
+  float* prolong(const BYTE* img, int width, int height, float* coarse,
+                 int& coarseWidth, int& coarseHeight, int& factor);
+
+  /// <summary>
+  /// Makes selected border bolder and returns image prepared to saving. The
+  /// border image covers only a window of the output, the rest is white.
+  /// </summary>
+  /// <param name="im">Border image of the window, 0 and 64 are borders and
+  /// 255 is empty</param>
+  /// <param name="minCoord">Position of the window in the output</param>
+  /// <param name="width">Output width</param>
+  /// <param name="height">Output height</param>
+  /// <returns>Image with bold border</returns>
+  Image<BYTE> boldBorder(const Image<BYTE>& im, const vec2<int>& minCoord,
+                         int width, int height);
 
   /// <summary>
   /// Gauss-Seidel iteration using variable kernel.
@@ -118,11 +227,27 @@ class ShapeFill {
   /// </summary>
   /// <param name="compSpace">Working space</param>
   /// <param name="dists">Distance transform</param>
-  /// <param name="borders">Boundary conditions</param>
+  /// <param name="borders">Labels of the boundary conditions</param>
   /// <param name="width">Image selection width</param>
   /// <param name="height">Image selection height</param>
-  void GaussSeidelVar(float* compSpace, float* dists, float* borders, int width,
-                      int height);
+  void GaussSeidelVar(float* compSpace, float* dists, const BYTE* borders,
+                      int width, int height);
+
+  /// <summary>
+  /// Red-black ordered variant of GaussSeidelVar. Kernel distances are made
+  /// odd, so every pixel reads only pixels of the other color and the rows of
+  /// one color are relaxed in parallel (with AVX2 if available). Converges to
+  /// the same solution as GaussSeidelVar. The unit kernel iterations use
+  /// Chebyshev accelerated SOR and stop on the maximum norm of the residual
+  /// or on the budgets.
+  /// </summary>
+  /// <param name="compSpace">Working space</param>
+  /// <param name="dists">Distance transform</param>
+  /// <param name="width">Image selection width</param>
+  /// <param name="height">Image selection height</param>
+  /// <returns>Convergence statistics</returns>
+  SolverStats GaussSeidelVarRB(float* compSpace, float* dists, int width,
+                               int height);
 
   /// <summary>
   /// Gauss-Seidel iteration using variable kernel.
@@ -130,10 +255,11 @@ class ShapeFill {
   /// https://www.cg.tuwien.ac.at/research/publications/2009/jeschke-09-solver/jeschke-09-solver-paper.pdf
   /// </summary>
   /// <param name="compSpace">Working space</param>
-  /// <param name="borders">Boundary conditions</param>
+  /// <param name="borders">Labels of the boundary conditions</param>
   /// <param name="width">Image selection width</param>
   /// <param name="height">Image selection height</param>
-  void GaussSeidel(float* compSpace, float* borders, int width, int height);
+  void GaussSeidel(float* compSpace, const BYTE* borders, int width,
+                   int height);
 
   /// <summary>
   /// Shape fil run function managing each step for computing the segment
@@ -143,17 +269,59 @@ class ShapeFill {
   /// <param name="depth">Depth data</param>
   /// <param name="borders">Image containing uniform borders</param>
   /// <param name="block">Merge blocking selection</param>
-  /// <param name="orig">Original image</param>
+  /// <param name="orig">Mask of the white pixels</param>
   /// <param name="mins">Array of minimal coordinates</param>
   /// <param name="maxs">Array of maximal coordinates</param>
   /// <param name="seg">Current segment ID</param>
   /// <param name="incidences">Array of neighbours for each segment</param>
   /// <param name="number">Number for export</param>
   void SFRun(const ColorMap& c_map, const Depth& depth, char* borders,
-             BYTE* block, float* orig, std::vector<vec2<int>>& mins,
+             BYTE* block, const BYTE* orig, std::vector<vec2<int>>& mins,
              std::vector<vec2<int>>& maxs, BYTE seg,
              std::vector<std::set<short>>& incidences, int& number);
 
+  /// <summary>
+  /// Hashes everything the layers of the segment are computed from, that is
+  /// the window of the segment with one pixel margin in the color map, the
+  /// borders, the selection and the processed original image, the
+  /// neighbours of the segment, the depths of the segments in the window
+  /// and the arrows of the segment.
+  /// </summary>
+  /// <param name="c_map">Color map</param>
+  /// <param name="depth">Depth data</param>
+  /// <param name="borders">Segment borders</param>
+  /// <param name="block">Merge blocking selection</param>
+  /// <param name="orig">Mask of the white pixels</param>
+  /// <param name="minC">Minimal coordinate of the segment window</param>
+  /// <param name="maxC">Maximal coordinate of the segment window</param>
+  /// <param name="seg">Segment identifier</param>
+  /// <param name="incidences">Neighbours of the segment</param>
+  /// <returns>Fingerprint of the inputs</returns>
+  uint64_t fingerprint(const ColorMap& c_map, const Depth& depth,
+                       const char* borders, const BYTE* block,
+                       const BYTE* orig, const vec2<int>& minC,
+                       const vec2<int>& maxC, BYTE seg,
+                       const std::set<short>& incidences);
+
+  /// <summary>
+  /// Exports the cached layers of the segment when they were computed from
+  /// the same inputs.
+  /// </summary>
+  /// <param name="seg">Segment identifier</param>
+  /// <param name="key">Fingerprint of the current inputs</param>
+  /// <param name="number">Number for export</param>
+  /// <returns>Whether the cached layers were used</returns>
+  bool reuseLayers(BYTE seg, uint64_t key, int number);
+
+  /// <summary>
+  /// Queues the layer and keeps a copy of its PNG data for the next export.
+  /// </summary>
+  /// <param name="name">Entry name</param>
+  /// <param name="store">Storage of the produced data</param>
+  /// <param name="producer">Producer of the PNG data</param>
+  void addLayer(const std::string& name,
+                std::shared_ptr<std::vector<unsigned char>> store,
+                ProjectExport::Producer producer);
 
   /// <summary>
   /// Handles the 4-neighborhood during the border creation.
@@ -169,26 +337,28 @@ class ShapeFill {
   /// <param name="alone">Flag for segments with no computable border</param>
   /// <param name="neighHigher"></param>
   /// <param name="firstNeigh"></param>
-  /// <param name="im"></param>
+  /// <param name="im">Mask of the white pixels</param>
   void handleNeighborhood(char* borders, int w, int h, int dW, int dH,
                           const Depth& depth, const ColorMap& c_map, BYTE seg,
                           bool* alone, bool* neighHigher, short* firstNeigh,
-                          float* im);
+                          const BYTE* im);
 
   /// <summary>
   /// Creates borders of each segment, finds their neighbours and sets minimal
   /// and maximal coordinates for computation space dedicated for each segment.
+  /// The space covers the segment and the pixels of the closer segments
+  /// connected to it.
   /// </summary>
   /// <param name="borders">Output image containing uniform borders</param>
   /// <param name="depth">Depth data</param>
-  /// <param name="im">Intensity image</param>
+  /// <param name="im">Mask of the white pixels</param>
   /// <param name="c_map">Color map containing each segment data</param>
   /// <param name="mins">Array of minimal coordinates</param>
   /// <param name="maxs">Array of maximal coordinates</param>
   /// <param name="incidences">Array of neighbours for each segment</param>
   /// <param name="block">Selection data</param>
   /// <returns>Whether the segments are alone</returns>
-  bool* createBorders(char* borders, const Depth& depth, float* im,
+  bool* createBorders(char* borders, const Depth& depth, const BYTE* im,
                       const ColorMap& c_map, std::vector<vec2<int>>& mins,
                       std::vector<vec2<int>>& maxs,
                       std::vector<std::set<short>>& incidences, BYTE* block);
@@ -196,8 +366,8 @@ class ShapeFill {
   /// <summary>
   /// Saves segment and boundary images based on the estimation.
   /// </summary>
-  /// <param name="estimate">Estimated image</param>
-  /// <param name="orig">Original image</param>
+  /// <param name="estimate">Tresholded estimate labels</param>
+  /// <param name="orig">Mask of the white pixels</param>
   /// <param name="block">Merge blocking selection</param>
   /// <param name="c_map">Color map</param>
   /// <param name="depth">Depth data</param>
@@ -206,20 +376,20 @@ class ShapeFill {
   /// <param name="minCoord">Minimal coordinate</param>
   /// <param name="num">Save number</param>
   /// <param name="seg">Segment identifier</param>
-  void setBoundary(float* estimate, float* orig, BYTE* block,
+  void setBoundary(const BYTE* estimate, const BYTE* orig, BYTE* block,
                    const ColorMap& c_map, const Depth& depth, int width,
                    int height, const vec2<int>& minCoord, BYTE num, BYTE seg);
 
   /// <summary>
   /// Selects computing space and sets its boundary, i.e its conditions.
   /// </summary>
-  /// <param name="src">Source image</param>
-  /// <param name="dst">Output image</param>
+  /// <param name="src">Source labels</param>
+  /// <param name="dst">Output labels</param>
   /// <param name="width">Image width</param>
   /// <param name="height">Image height</param>
   /// <param name="ids">IDs of each unknown pixel</param>
   /// <param name="n">Number of pixels to be computed</param>
-  void findBorder(float* src, float* dst, int width, int height,
+  void findBorder(const BYTE* src, BYTE* dst, int width, int height,
                   int* ids = nullptr, int* n = nullptr);
 
   /// <summary>
@@ -227,21 +397,23 @@ class ShapeFill {
   /// </summary>
   /// <param name="c_map">Color map containing data for each segment</param>
   /// <param name="img">Input image containing estimated data</param>
+  /// <param name="out">Output labels, white pixels belong to the
+  /// segment</param>
   /// <param name="width">Image width</param>
   /// <param name="height">Image height</param>
   /// <param name="coord">Minimal coordinate in the original image</param>
   /// <param name="incidences">Neighbours IDs incident to current
   /// segment</param> <param name="seg">Current segment ID</param>
-  void treshold(const ColorMap& c_map, float* img, int width, int height,
-                const vec2<int>& coord, const std::set<short>& incidences,
-                BYTE seg);
+  void treshold(const ColorMap& c_map, const float* img, BYTE* out, int width,
+                int height, const vec2<int>& coord,
+                const std::set<short>& incidences, BYTE seg);
 
   /// <summary>
   /// Creates template image.
   /// </summary>
   /// <param name="c_map">Color map</param>
   ///  <param name="orig">Original intensity image</param>
-  Image<RGB> templateData(const ColorMap& c_map, std::string& filename);
+  Image<RGBA8> templateData(const ColorMap& c_map, std::string& filename);
 
   /// <summary>
   /// Creates content for the settings.txt file.
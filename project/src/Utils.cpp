@@ -25,18 +25,41 @@
 
 #include "Utils.h"
 
+#include <immintrin.h>
+
+#include <algorithm>
 #include <cmath>
+#include <complex>
+#include <vector>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "Parallel.h"
+#include "Resample.h"
+
+bool Utils::hasAVX2() {
+  static const bool avx2 = []() {
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7) return false;
+    // AVX has to be enabled by the system to save the registers
+    __cpuid(regs, 1);
+    if ((regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0) return false;
+    if ((_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+  }();
+  return avx2;
+}
 
 void Utils::scale(Image<float>& im, int width, int height) {
-  Image<float> tmp(width, height);
-  float scaleX = (float)im.width() / (float)width;
-  float scaleY = (float)im.height() / (float)height;
-  for (int h = 0; h < height; h++) {
-    for (int w = 0; w < width; w++) {
-      tmp(w, h) = im(w * scaleX, h * scaleY);
-    }
-  }
-  im = tmp;
+  Resample::resize(im, width, height,
+                   Resample::filterFor(im.width(), width));
 }
 
 void Utils::scaleAndPad(Image<float>& im) {
@@ -44,18 +67,17 @@ void Utils::scaleAndPad(Image<float>& im) {
   float MMratio = (float)MM_WIDTH / (float)MM_HEIGHT;  // 10 : 8 -> 1,25
   float ratio = (float)im.width() / (float)im.height();
 
+  int width = MM_WIDTH, height = MM_HEIGHT;
   // image is proportionally wider than expected ratio
-  // and scale is needed
-  if (ratio > MMratio && im.width() != MM_WIDTH) {
-    scale(im, MM_WIDTH, im.height() * MM_WIDTH / im.width());
+  if (ratio > MMratio) {
+    height = im.height() * MM_WIDTH / im.width();
   }
   // image is proportionally heigher than expected ratio
-  // and scale is needed
-  else if (ratio < MMratio && im.height() != MM_HEIGHT) {
-    scale(im, im.width() * MM_HEIGHT / im.height(), MM_HEIGHT);
+  else if (ratio < MMratio) {
+    width = im.width() * MM_HEIGHT / im.height();
   }
   // ratio is the same but the sizes differ, no padding is needed
-  else {
+  if (width == MM_WIDTH && height == MM_HEIGHT) {
     scale(im, MM_WIDTH, MM_HEIGHT);
     return;
   }
@@ -64,28 +86,25 @@ void Utils::scaleAndPad(Image<float>& im) {
   Image<float> ret(MM_WIDTH, MM_HEIGHT);
   for (int i = 0; i < MM_WIDTH * MM_HEIGHT; i++) ret.data()[i] = 1.0f;
 
-  // find the first coordinates of the scaled image
-  int sw = (MM_WIDTH - im.width()) / 2.0f,
-      sh = (MM_HEIGHT - im.height()) / 2.0f;
+  // the scaled image is written to the middle of the returned one
+  int sw = (MM_WIDTH - width) / 2.0f, sh = (MM_HEIGHT - height) / 2.0f;
+  Resample::resize(im.data(), im.width(), im.height(),
+                   ret.data() + sw + sh * MM_WIDTH, width, height, MM_WIDTH,
+                   Resample::filterFor(im.width(), width));
+  im = std::move(ret);
+}
 
-  for (int h = sh, y = 0; y < im.height(); h++, y++) {
-    for (int w = sw, x = 0; x < im.width(); w++, x++) {
-      ret(w, h) = im(x, y);
+void Utils::gammaCorrection(ImageView<float> img, BYTE expL) {
+  float* im = img.data();
+  for (int h = 0; h < img.height(); h += 1) {
+    for (int w = 0; w < img.width(); w += 1) {
+      im[w + h * img.width()] = std::powf(im[w + h * img.width()], EXPONENT);
     }
   }
-  im = ret;
-}
-
-void Utils::gammaCorrection(Image<float>& img, BYTE expL) {
-  gammaCorrection(img.data(), img.width(), img.height(), expL);
 }
 
 void Utils::gammaCorrection(float* im, int width, int height, BYTE expL) {
-  for (int h = 0; h < height; h += 1) {
-    for (int w = 0; w < width; w += 1) {
-      im[w + h * width] = std::powf(im[w + h * width], EXPONENT);
-    }
-  }
+  gammaCorrection(ImageView<float>(im, width, height), expL);
 }
 
 void Utils::gammaCorrectionPlusTreshold(float* im, int width, int height) {
@@ -97,35 +116,35 @@ void Utils::gammaCorrectionPlusTreshold(float* im, int width, int height) {
   }
 }
 
-void Utils::blur(Image<float>& im, float varianceLevel) {
+void Utils::blur(ImageView<float> im, float varianceLevel, BlurFilter filter) {
   float variance = 1.0f + VARIANCE_BASE * varianceLevel;
+  if (filter == BLUR_IIR) {
+    recursiveGaussian(im.data(), im.width(), im.height(), variance);
+    return;
+  }
   int radius = 6 * variance + 1;
 
   float* ker = computeKernel(variance, radius);
-  convolution_separableKernel(ker, im, radius);
+  convolution_separableKernel(ker, im.data(), im.width(), im.height(),
+                              radius);
 }
 
-void Utils::blur(float* im, int width, int height, BYTE varianceLevel) {
-  Image<float> img(width, height);
-  memcpy(img.data(), im, width * height * sizeof(float));
-  blur(img, varianceLevel);
-  memcpy(im, img.data(), width * height * sizeof(float));
+void Utils::blur(float* im, int width, int height, BYTE varianceLevel,
+                 BlurFilter filter) {
+  blur(ImageView<float>(im, width, height), varianceLevel, filter);
 }
 
-void Utils::blurAndTreshold(Image<float>& img) {
-  blurAndTreshold(img.data(), img.width(), img.height());
+void Utils::blurAndTreshold(ImageView<float> img) {
+  blur(img, 1.5f);
+
+  float* image = img.data();
+  for (int i = 0; i < img.width() * img.height(); i++) {
+    image[i] = image[i] > 0.65f ? 1.0f : 0.0f;
+  }
 }
 
 void Utils::blurAndTreshold(float* image, int width, int height) {
-  Image<float> tmp(width, height);
-  memcpy(tmp.data(), image, width * height * sizeof(float));
-  Utils::scaleAndPad(tmp);
-
-  blur(tmp, 1.5f);
-
-  for (int i = 0; i < width * height; i++) {
-    image[i] = tmp.data()[i] > 0.65f ? 1.0f : 0.0f;
-  }
+  blurAndTreshold(ImageView<float>(image, width, height));
 }
 
 float* Utils::computeKernel(double variance, int radius) {
@@ -142,66 +161,526 @@ float* Utils::computeKernel(double variance, int radius) {
   return kernel;
 }
 
-void Utils::convolution_separableKernel(float* kernel, Image<float>& img,
+/// <summary>
+/// Width of the column strips of the separable convolution. The rows of a
+/// strip the kernel covers stay in the cache.
+/// </summary>
+static const int CONV_STRIP = 256;
+
+/// <summary>
+/// Convolution of one pixel of the row with the taps clamped to the row.
+/// </summary>
+/// <param name="src">Source row</param>
+/// <param name="width">Row width</param>
+/// <param name="kernel">Convolution kernel</param>
+/// <param name="radius">Kernel radius</param>
+/// <param name="w">Column</param>
+/// <returns>Convolved value</returns>
+static inline float clampedTaps(const float* src, int width,
+                                const float* kernel, int radius, int w) {
+  float sum = 0.0f;
+  for (int r = -radius; r <= radius; r++) {
+    int x = std::min(std::max(w + r, 0), width - 1);
+    sum += src[x] * kernel[r + radius];
+  }
+  return sum;
+}
+
+/// <summary>
+/// Row pass of the separable convolution. The border pixels clamp the taps,
+/// the interior ones read the row directly.
+/// </summary>
+/// <param name="src">Source row</param>
+/// <param name="dst">Output row</param>
+/// <param name="width">Row width</param>
+/// <param name="kernel">Convolution kernel</param>
+/// <param name="radius">Kernel radius</param>
+static void convolveRow(const float* src, float* dst, int width,
+                        const float* kernel, int radius) {
+  int lo = std::min(radius, width), hi = std::max(width - radius, lo);
+  for (int w = 0; w < lo; w++) {
+    dst[w] = clampedTaps(src, width, kernel, radius, w);
+  }
+  for (int w = lo; w < hi; w++) {
+    const float* in = src + w - radius;
+    float sum = 0.0f;
+    for (int t = 0; t <= 2 * radius; t++) sum += in[t] * kernel[t];
+    dst[w] = sum;
+  }
+  for (int w = hi; w < width; w++) {
+    dst[w] = clampedTaps(src, width, kernel, radius, w);
+  }
+}
+
+/// <summary>
+/// AVX2 version of convolveRow, eight interior pixels are convolved at once.
+/// The taps are accumulated in the same order, so the results are equal.
+/// </summary>
+/// <param name="src">Source row</param>
+/// <param name="dst">Output row</param>
+/// <param name="width">Row width</param>
+/// <param name="kernel">Convolution kernel</param>
+/// <param name="radius">Kernel radius</param>
+TARGET_AVX2 static void convolveRowAVX2(const float* src, float* dst,
+                                        int width, const float* kernel,
                                         int radius) {
-  int width = img.width();
-  int height = img.height();
-  float* tmp = new float[height * width];
-  float* tmp2 = new float[height * width];
-  // process rows
-  for (int h = 0; h < height; h++) {
-    for (int w = 0; w < width; w++) {
-      tmp[h * width + w] = 0;
+  int lo = std::min(radius, width), hi = std::max(width - radius, lo);
+  for (int w = 0; w < lo; w++) {
+    dst[w] = clampedTaps(src, width, kernel, radius, w);
+  }
+  int w = lo;
+  for (; w + 8 <= hi; w += 8) {
+    const float* in = src + w - radius;
+    __m256 sum = _mm256_setzero_ps();
+    for (int t = 0; t <= 2 * radius; t++) {
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(in + t),
+                                             _mm256_set1_ps(kernel[t])));
+    }
+    _mm256_storeu_ps(dst + w, sum);
+  }
+  for (; w < hi; w++) {
+    const float* in = src + w - radius;
+    float sum = 0.0f;
+    for (int t = 0; t <= 2 * radius; t++) sum += in[t] * kernel[t];
+    dst[w] = sum;
+  }
+  for (w = hi; w < width; w++) {
+    dst[w] = clampedTaps(src, width, kernel, radius, w);
+  }
+}
 
-      for (int r = -radius; r <= radius; r += 1) {
-        int rwidx = r + w;
-        rwidx = rwidx < 0 ? 0 : (rwidx >= width ? width - 1 : rwidx);
-        float var = img(rwidx, h) * kernel[r + radius];
-        tmp[h * width + w] += var;
-      }
+/// <summary>
+/// Convolution of the strip [x0, x1) of one row with AVX2.
+/// </summary>
+/// <param name="rows">Rows covered by the kernel</param>
+/// <param name="out">Output row</param>
+/// <param name="x0">First column</param>
+/// <param name="x1">Column after the last one</param>
+/// <param name="kernel">Convolution kernel</param>
+/// <param name="taps">Kernel length</param>
+TARGET_AVX2 static void convolveStripAVX2(const float* const* rows,
+                                          float* out, int x0, int x1,
+                                          const float* kernel, int taps) {
+  int x = x0;
+  for (; x + 8 <= x1; x += 8) {
+    __m256 sum = _mm256_setzero_ps();
+    for (int t = 0; t < taps; t++) {
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(rows[t] + x),
+                                             _mm256_set1_ps(kernel[t])));
     }
+    _mm256_storeu_ps(out + x, sum);
   }
-  // process columns
-  for (int h = 0; h < height; h++) {
-    for (int w = 0; w < width; w++) {
-      tmp2[h * width + w] = 0;
+  for (; x < x1; x++) {
+    float sum = 0.0f;
+    for (int t = 0; t < taps; t++) sum += rows[t][x] * kernel[t];
+    out[x] = sum;
+  }
+}
+
+/// <summary>
+/// Convolution of the strip [x0, x1) of one row.
+/// </summary>
+/// <param name="rows">Rows covered by the kernel</param>
+/// <param name="out">Output row</param>
+/// <param name="x0">First column</param>
+/// <param name="x1">Column after the last one</param>
+/// <param name="kernel">Convolution kernel</param>
+/// <param name="taps">Kernel length</param>
+static void convolveStrip(const float* const* rows, float* out, int x0,
+                          int x1, const float* kernel, int taps) {
+  for (int x = x0; x < x1; x++) {
+    float sum = 0.0f;
+    for (int t = 0; t < taps; t++) sum += rows[t][x] * kernel[t];
+    out[x] = sum;
+  }
+}
 
-      for (int r = -radius; r <= radius; r += 1) {
-        int rhidx = r + h;
-        rhidx = rhidx < 0 ? 0 : (rhidx >= height ? height - 1 : rhidx);
-        float var = tmp[rhidx * width + w] * kernel[r + radius];
-        tmp2[h * width + w] += var;
+/// <summary>
+/// Column pass of the separable convolution of the rows [from, to). The
+/// rows out of the image are clamped to its border.
+/// </summary>
+/// <param name="src">Output of the row pass</param>
+/// <param name="dst">Output image</param>
+/// <param name="width">Image width</param>
+/// <param name="height">Image height</param>
+/// <param name="kernel">Convolution kernel</param>
+/// <param name="radius">Kernel radius</param>
+/// <param name="from">First row</param>
+/// <param name="to">Row after the last one</param>
+/// <param name="avx2">Use AVX2 instructions</param>
+static void convolveColumns(const float* src, float* dst, int width,
+                            int height, const float* kernel, int radius,
+                            int from, int to, bool avx2) {
+  int taps = 2 * radius + 1;
+  std::vector<const float*> rows(taps);
+  for (int x0 = 0; x0 < width; x0 += CONV_STRIP) {
+    int x1 = std::min(x0 + CONV_STRIP, width);
+    for (int h = from; h < to; h++) {
+      for (int t = 0; t < taps; t++) {
+        int y = std::min(std::max(h + t - radius, 0), height - 1);
+        rows[t] = src + (size_t)y * width;
+      }
+      float* out = dst + (size_t)h * width;
+      if (avx2) {
+        convolveStripAVX2(rows.data(), out, x0, x1, kernel, taps);
+      } else {
+        convolveStrip(rows.data(), out, x0, x1, kernel, taps);
       }
     }
   }
+}
 
-  // save results
-  for (int h = 0; h < height; h++) {
-    for (int w = 0; w < width; w++) {
-      img(w, h) = tmp2[h * width + w];
-    }
+void Utils::convolution_separableKernel(float* kernel, float* img, int width,
+                                        int height, int radius) {
+  // the intermediate image is kept for the following calls
+  static thread_local std::vector<float> tmp;
+  tmp.resize((size_t)width * height);
+  float* rowPass = tmp.data();
+  bool avx2 = hasAVX2();
+  Parallel::ThreadPool& pool = Parallel::ThreadPool::shared();
+
+  // process rows
+  pool.parallelFor(
+      0, height,
+      [&](int from, int to) {
+        for (int h = from; h < to; h++) {
+          const float* src = img + (size_t)h * width;
+          float* dst = rowPass + (size_t)h * width;
+          if (avx2) {
+            convolveRowAVX2(src, dst, width, kernel, radius);
+          } else {
+            convolveRow(src, dst, width, kernel, radius);
+          }
+        }
+      },
+      16);
+  // process columns strip by strip, the results overwrite the image
+  pool.parallelFor(
+      0, height,
+      [&](int from, int to) {
+        convolveColumns(rowPass, img, width, height, kernel, radius, from, to,
+                        avx2);
+      },
+      16);
+
+  delete[] kernel;
+}
+
+/// <summary>
+/// Rows of the image blurred at once by gammaBlurAndTreshold. The row pass
+/// of a band and of its margins fits in the cache.
+/// </summary>
+static const int PREPROCESS_BAND = 64;
+
+/// <summary>
+/// Power with a non-negative integer exponent computed by squaring.
+/// </summary>
+/// <param name="x">Base</param>
+/// <param name="n">Exponent</param>
+/// <returns>x to the power of n</returns>
+static inline float powInt(float x, int n) {
+  float ret = 1.0f;
+  for (; n > 0; n >>= 1) {
+    if (n & 1) ret *= x;
+    x *= x;
   }
+  return ret;
+}
+
+void Utils::gammaBlurAndTreshold(const float* image, BYTE* mask, int width,
+                                 int height) {
+  static_assert(EXPONENT == (float)(int)EXPONENT,
+                "gamma by squaring needs an integer exponent");
+  float variance = 1.0f + VARIANCE_BASE * 1.5f;
+  int radius = 6 * variance + 1;
+  int taps = 2 * radius + 1;
+  float* kernel = computeKernel(variance, radius);
+  bool avx2 = hasAVX2();
+  int bands = (height + PREPROCESS_BAND - 1) / PREPROCESS_BAND;
+
+  Parallel::ThreadPool::shared().parallelFor(0, bands, [&](int from,
+                                                           int to) {
+    std::vector<float> rowPass((size_t)(PREPROCESS_BAND + 2 * radius) *
+                               width);
+    std::vector<float> line(width);
+    std::vector<const float*> rows(taps);
+    for (int b = from; b < to; b++) {
+      int y0 = b * PREPROCESS_BAND;
+      int y1 = std::min(y0 + PREPROCESS_BAND, height);
+      int r0 = std::max(y0 - radius, 0), r1 = std::min(y1 + radius, height);
+      // gamma and the row pass of the band with the rows the kernel covers
+      for (int y = r0; y < r1; y++) {
+        const float* src = image + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+          line[x] = powInt(src[x], (int)EXPONENT);
+        }
+        float* dst = rowPass.data() + (size_t)(y - r0) * width;
+        if (avx2) {
+          convolveRowAVX2(line.data(), dst, width, kernel, radius);
+        } else {
+          convolveRow(line.data(), dst, width, kernel, radius);
+        }
+      }
+      // column pass, the line is reused for the blurred row
+      for (int h = y0; h < y1; h++) {
+        for (int t = 0; t < taps; t++) {
+          int y = std::min(std::max(h + t - radius, 0), height - 1);
+          rows[t] = rowPass.data() + (size_t)(y - r0) * width;
+        }
+        if (avx2) {
+          convolveStripAVX2(rows.data(), line.data(), 0, width, kernel, taps);
+        } else {
+          convolveStrip(rows.data(), line.data(), 0, width, kernel, taps);
+        }
+        BYTE* out = mask + (size_t)h * width;
+        for (int x = 0; x < width; x++) out[x] = line[x] > 0.65f ? 1 : 0;
+      }
+    }
+  });
 
-  delete[] tmp;
-  delete[] tmp2;
   delete[] kernel;
 }
 
-void Utils::edgeDetect(float* img, int width, int height) {
-  float* img_copy = new float[width * height];
-  memcpy(img_copy, img, width * height * sizeof(float));
+/// <summary>
+/// Coefficients of the recursive Gaussian filter of Young, van Vliet and van
+/// Ginkel with the boundary conditions of Triggs and Sdika. The border
+/// pixels are replicated as in the convolution.
+/// </summary>
+struct RecursiveGaussian {
+  float b, a1, a2, a3;
+  // initial state of the backward pass from the forward one, scaled by b
+  float m[3][3];
+
+  explicit RecursiveGaussian(double sigma) {
+    // poles of the filter of sigma 2, scaling them by q changes the variance
+    const std::complex<double> base[3] = {{1.40098, 1.00236},
+                                          {1.40098, -1.00236},
+                                          {1.85132, 0.0}};
+    std::complex<double> poles[3];
+    double lo = 0.01, hi = 4.0 * sigma + 4.0;
+    for (int it = 0; it < 64; it++) {
+      double q = 0.5 * (lo + hi), variance = 0.0;
+      for (int k = 0; k < 3; k++) {
+        poles[k] = std::polar(std::pow(std::abs(base[k]), 1.0 / q),
+                              std::arg(base[k]) / q);
+        variance += 2.0 * (poles[k] / ((poles[k] - 1.0) * (poles[k] - 1.0)))
+                              .real();
+      }
+      if (variance < sigma * sigma) {
+        lo = q;
+      } else {
+        hi = q;
+      }
+    }
+    // expand the denominator (1 - z^-1 / d1)(1 - z^-1 / d2)(1 - z^-1 / d3)
+    std::complex<double> c[4] = {1.0, 0.0, 0.0, 0.0};
+    for (int k = 0; k < 3; k++) {
+      for (int j = 3; j >= 1; j--) c[j] -= c[j - 1] / poles[k];
+    }
+    double c1 = -c[1].real(), c2 = -c[2].real(), c3 = -c[3].real();
+    double cb = 1.0 - (c1 + c2 + c3);
+    double s = cb / ((1.0 + c1 - c2 + c3) * (1.0 - c1 - c2 - c3) *
+                     (1.0 + c2 + (c1 - c3) * c3));
+    m[0][0] = s * (-c3 * c1 + 1.0 - c3 * c3 - c2);
+    m[0][1] = s * (c3 + c1) * (c2 + c3 * c1);
+    m[0][2] = s * c3 * (c1 + c3 * c2);
+    m[1][0] = s * (c1 + c3 * c2);
+    m[1][1] = -s * (c2 - 1.0) * (c2 + c3 * c1);
+    m[1][2] = -s * c3 * (c3 * c1 + c3 * c3 + c2 - 1.0);
+    m[2][0] = s * (c3 * c1 + c2 + c1 * c1 - c2 * c2);
+    m[2][1] = s * (c1 * c2 + c3 * c2 * c2 - c1 * c3 * c3 - c3 * c3 * c3 -
+                   c3 * c2 + c3);
+    m[2][2] = s * c3 * (c1 + c3 * c2);
+    b = cb;
+    a1 = c1;
+    a2 = c2;
+    a3 = c3;
+  }
+};
+
+/// <summary>
+/// Filters count lines in place by the forward and the backward recursion.
+/// The lines are processed together, so their independent recursions
+/// overlap and the inner loops over neighbouring columns vectorize.
+/// </summary>
+/// <param name="data">First value of the first line</param>
+/// <param name="length">Line length</param>
+/// <param name="step">Distance of the values of a line</param>
+/// <param name="count">Number of the lines</param>
+/// <param name="lineStep">Distance of the lines</param>
+/// <param name="g">Filter coefficients</param>
+/// <param name="state">Scratch of 5 * count values</param>
+static void recursiveLines(float* data, int length, size_t step, int count,
+                           size_t lineStep, const RecursiveGaussian& g,
+                           float* state) {
+  float* first = state;
+  float* last = state + count;
+  float* p1 = state + 2 * count;
+  float* p2 = state + 3 * count;
+  float* p3 = state + 4 * count;
+  const size_t end = (size_t)(length - 1) * step;
+  for (int i = 0; i < count; i++) {
+    first[i] = p1[i] = p2[i] = p3[i] = data[i * lineStep];
+    last[i] = data[end + i * lineStep];
+  }
+  // causal pass, constant signal before the line keeps its steady state
+  for (int n = 0; n < length; n++) {
+    float* at = data + (size_t)n * step;
+    for (int i = 0; i < count; i++) {
+      float& v = at[i * lineStep];
+      float w = g.b * v + g.a1 * p1[i] + g.a2 * p2[i] + g.a3 * p3[i];
+      p3[i] = p2[i];
+      p2[i] = p1[i];
+      p1[i] = w;
+      v = w;
+    }
+  }
+  // anticausal pass starts from the response to the replicated last value,
+  // the causal output before the line is the first value
+  for (int i = 0; i < count; i++) {
+    const float* line = data + i * lineStep;
+    float u0 = line[end] - last[i];
+    float u1 = (length > 1 ? line[end - step] : first[i]) - last[i];
+    float u2 = (length > 2 ? line[end - 2 * step] : first[i]) - last[i];
+    p1[i] = g.m[0][0] * u0 + g.m[0][1] * u1 + g.m[0][2] * u2 + last[i];
+    p2[i] = g.m[1][0] * u0 + g.m[1][1] * u1 + g.m[1][2] * u2 + last[i];
+    p3[i] = g.m[2][0] * u0 + g.m[2][1] * u1 + g.m[2][2] * u2 + last[i];
+    data[end + i * lineStep] = p1[i];
+  }
+  for (int n = length - 2; n >= 0; n--) {
+    float* at = data + (size_t)n * step;
+    for (int i = 0; i < count; i++) {
+      float& v = at[i * lineStep];
+      float y = g.b * v + g.a1 * p1[i] + g.a2 * p2[i] + g.a3 * p3[i];
+      p3[i] = p2[i];
+      p2[i] = p1[i];
+      p1[i] = y;
+      v = y;
+    }
+  }
+}
 
+void Utils::recursiveGaussian(float* img, int width, int height,
+                              double sigma) {
+  // rows are filtered by groups interleaving their recursions
+  const int group = 8;
+  RecursiveGaussian g(sigma);
+  Parallel::ThreadPool& pool = Parallel::ThreadPool::shared();
+  if (width <= 0 || height <= 0) return;
+  std::pair<float*, float*> range =
+      std::minmax_element(img, img + (size_t)width * height);
+  const float lo = *range.first, hi = *range.second;
+
+  pool.parallelFor(
+      0, (height + group - 1) / group,
+      [&](int from, int to) {
+        float state[5 * group];
+        for (int r = from; r < to; r++) {
+          int count = std::min(group, height - r * group);
+          recursiveLines(img + (size_t)r * group * width, width, 1, count,
+                         width, g, state);
+        }
+      },
+      2);
+  // columns in strips, the recursion runs over the rows of the strip
+  int strips = (width + CONV_STRIP - 1) / CONV_STRIP;
+  pool.parallelFor(0, strips, [&](int from, int to) {
+    std::vector<float> state(5 * CONV_STRIP);
+    for (int s = from; s < to; s++) {
+      int x0 = s * CONV_STRIP;
+      int count = std::min(CONV_STRIP, width - x0);
+      recursiveLines(img + x0, height, width, count, 1, g, state.data());
+      for (int h = 0; h < height; h++) {
+        float* row = img + (size_t)h * width + x0;
+        for (int x = 0; x < count; x++) {
+          row[x] = std::min(std::max(row[x], lo), hi);
+        }
+      }
+    }
+  });
+}
+
+void Utils::separableLoG(const float* img, double* out, int width,
+                         int height, float sigma, int radius) {
+  // LoG(x, y) = (A(x) G(y) + G(x) A(y)) / (pi sigma^2), where G is the
+  // Gaussian and A(t) = (t^2 / (2 sigma^2) - 1 / 2) G(t)
+  int len = 2 * radius + 1;
+  std::vector<double> gauss(len), second(len);
+  for (int t = -radius; t <= radius; t++) {
+    double g = std::exp(-(double)(t * t) / (2.0 * sigma * sigma));
+    gauss[t + radius] = g;
+    second[t + radius] = ((double)(t * t) / (2.0 * sigma * sigma) - 0.5) * g /
+                         (M_PI * sigma * sigma);
+  }
+  size_t size = (size_t)width * height;
+  std::vector<double> rowsA(size), rowsG(size);
+  Parallel::ThreadPool& pool = Parallel::ThreadPool::shared();
+
+  // process rows, only the taps of the border pixels are clamped
+  pool.parallelFor(
+      0, height,
+      [&](int from, int to) {
+        int lo = std::min(radius, width);
+        int hi = std::max(width - radius, lo);
+        for (int h = from; h < to; h++) {
+          const float* src = img + (size_t)h * width;
+          double* dA = rowsA.data() + (size_t)h * width;
+          double* dG = rowsG.data() + (size_t)h * width;
+          for (int w = 0; w < width; w++) {
+            double sumA = 0.0, sumG = 0.0;
+            if (w >= lo && w < hi) {
+              const float* in = src + w - radius;
+              for (int t = 0; t < len; t++) {
+                sumA += in[t] * second[t];
+                sumG += in[t] * gauss[t];
+              }
+            } else {
+              for (int t = 0; t < len; t++) {
+                int x = std::min(std::max(w + t - radius, 0), width - 1);
+                sumA += src[x] * second[t];
+                sumG += src[x] * gauss[t];
+              }
+            }
+            dA[w] = sumA;
+            dG[w] = sumG;
+          }
+        }
+      },
+      16);
+  // process columns, the row pass of A is smoothed by G and vice versa
+  pool.parallelFor(
+      0, height,
+      [&](int from, int to) {
+        std::vector<size_t> rows(len);
+        for (int h = from; h < to; h++) {
+          for (int t = 0; t < len; t++) {
+            int y = std::min(std::max(h + t - radius, 0), height - 1);
+            rows[t] = (size_t)y * width;
+          }
+          double* dst = out + (size_t)h * width;
+          for (int w = 0; w < width; w++) dst[w] = 0.0;
+          for (int t = 0; t < len; t++) {
+            const double* inA = rowsA.data() + rows[t];
+            const double* inG = rowsG.data() + rows[t];
+            for (int w = 0; w < width; w++) {
+              dst[w] += inA[w] * gauss[t] + inG[w] * second[t];
+            }
+          }
+        }
+      },
+      16);
+}
+
+void Utils::edgeDetect(float* img, int width, int height) {
   const float sigma = 3.0f;
   int radius = 6.0f * sigma + 1;
-  float* ker = computeKernel_2D(sigma, radius);
-  convolution(ker, img_copy, radius, width, height);
+  std::vector<double> response((size_t)width * height);
+  separableLoG(img, response.data(), width, height, sigma, radius);
 
   // save the results
   for (int i = 0; i < width * height; i++) {
-    img[i] = img_copy[i] < 0.0f ? 1.0f : 0.0f;
+    img[i] = response[i] < 0.0 ? 1.0f : 0.0f;
   }
-  delete[] ker;
-  delete[] img_copy;
   return;
 
   // const float  // sigma = 4.0f,
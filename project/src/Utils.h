@@ -27,6 +27,14 @@
 #include "Image.h"
 #include "defines.h"
 
+/// <summary>
+/// Implementations of the Gaussian blur.
+/// </summary>
+enum BlurFilter {
+  BLUR_FIR = 0,  // convolution with the kernel of radius 6 * sigma + 1
+  BLUR_IIR       // recursive filter, the cost does not depend on sigma
+};
+
 /// <summary>
 /// Contains useful basic tools.
 /// </summary>
@@ -54,15 +62,26 @@ static class Utils {
   static void blurAndTreshold(float* image, int width, int height);
 
   /// <summary>
-  /// Reads the image from memory and decides which kernel and other parameters
-  /// are used on the intensity image. In one case the blurAndTreshold is not
-  /// applied.
+  /// Blurs the image and tresholds it in place.
   /// </summary>
   /// <param name="image">Intensity image</param>
-  static void blurAndTreshold(Image<float>& img);
+  static void blurAndTreshold(ImageView<float> img);
+
+  /// <summary>
+  /// Gamma correction, blur and treshold of the intensity image fused into
+  /// one pass over bands of rows. The result is the mask of the white
+  /// pixels, no intermediate image of the whole size is allocated.
+  /// </summary>
+  /// <param name="image">Intensity image of the canvas size</param>
+  /// <param name="mask">Output mask, 1 for white pixels and 0 otherwise</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  static void gammaBlurAndTreshold(const float* image, BYTE* mask, int width,
+                                   int height);
 
   /// <summary>
-  /// Scale image.
+  /// Scale image. The reduction averages the covered area, the enlargement
+  /// interpolates bilinearly.
   /// </summary>
   /// <param name="im"></param>
   static void scale(Image<float>& im, int width, int height);
@@ -86,13 +105,14 @@ static class Utils {
   static void gammaCorrection(float* im, int width, int height, BYTE expL = 3);
 
   /// <summary>
-  /// Applies gamma correction to the image.
+  /// Applies gamma correction to the image in place.
   /// </summary>
   /// <param name="img"></param>
-  static void gammaCorrection(Image<float>& img, BYTE expL = 3);
+  static void gammaCorrection(ImageView<float> img, BYTE expL = 3);
 
   /// <summary>
-  /// Finds edges in the image.
+  /// Finds edges in the image, marks the pixels with negative Laplacian of
+  /// Gaussian of sigma 3.
   /// </summary>
   /// <param name="img"></param>
   /// <param name="width"></param>
@@ -100,11 +120,17 @@ static class Utils {
   static void edgeDetect(float* img, int width, int height);
 
   /// <summary>
-  /// Computes blur using predefined values.
+  /// Computes blur using predefined values. The recursive filter differs from
+  /// the convolution by less than 1.1 % of the range of the image values,
+  /// the error is largest at the corners of sharp edges. Both filters keep
+  /// the values in the range of the input, the overshoot of the recursive
+  /// one is clamped.
   /// </summary>
   /// <param name="img"></param>
   /// <param name="varianceLevel"></param>
-  static void blur(Image<float>& im, float varianceLevel = 1.0f);
+  /// <param name="filter">Blur implementation</param>
+  static void blur(ImageView<float> im, float varianceLevel = 1.0f,
+                   BlurFilter filter = BLUR_FIR);
 
   /// <summary>
   /// Computes blur using predefined values.
@@ -113,7 +139,9 @@ static class Utils {
   /// <param name="width"></param>
   /// <param name="height"></param>
   /// <param name="varianceLevel"></param>
-  static void blur(float* im, int width, int height, BYTE varianceLevel = 1);
+  /// <param name="filter">Blur implementation</param>
+  static void blur(float* im, int width, int height, BYTE varianceLevel = 1,
+                   BlurFilter filter = BLUR_FIR);
 
   /// <summary>
   /// Prints hue image.
@@ -137,6 +165,12 @@ static class Utils {
   /// <returns>HSL color</returns>
   static HSL RGB2HSL(RGB& rgb);
 
+  /// <summary>
+  /// Checks whether the processor and the system support AVX2 instructions.
+  /// </summary>
+  /// <returns>AVX2 support</returns>
+  static bool hasAVX2();
+
  private:
   /// <summary>
   /// Computes 1D Gaussian kernel by the equation G(x, y, sigma) = 1 / (sqrt(2 *
@@ -148,13 +182,47 @@ static class Utils {
   static float* computeKernel(double variance, int radius);
 
   /// <summary>
-  /// Convolution using separable 2D kernel saved as 1D kernel.
+  /// Convolution using separable 2D kernel saved as 1D kernel. The rows are
+  /// processed in parallel, the interior pixels without clamping and with
+  /// AVX2 when it is available, the columns in strips kept in the cache.
+  /// The kernel is released.
   /// </summary>
   /// <param name="kernel">Convolution kernel</param>
   /// <param name="img">Intensity image</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
   /// <param name="radius">kernel radius</param>
-  static void convolution_separableKernel(float* kernel, Image<float>& img,
-                                          int radius);
+  static void convolution_separableKernel(float* kernel, float* img,
+                                          int width, int height, int radius);
+
+  /// <summary>
+  /// Recursive Gaussian filter (Young and van Vliet) with 3 poles in each
+  /// direction. The border pixels are replicated exactly (Triggs and Sdika).
+  /// The filter overshoots at sharp edges, the result is clamped to the range
+  /// of the input values.
+  /// </summary>
+  /// <param name="img">Intensity image</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  /// <param name="sigma">Standard deviation</param>
+  static void recursiveGaussian(float* img, int width, int height,
+                                double sigma);
+
+  /// <summary>
+  /// Laplacian of Gaussian as the sum of two separable convolutions, which
+  /// equals the convolution with the kernel of computeKernel_2D. The rows
+  /// are processed in parallel, the sums are accumulated in double, so the
+  /// sign of the response is exact also in the flat areas, where it is close
+  /// to zero. The pixels out of the image are clamped to its border.
+  /// </summary>
+  /// <param name="img">Intensity image</param>
+  /// <param name="out">Output response</param>
+  /// <param name="width">Image width</param>
+  /// <param name="height">Image height</param>
+  /// <param name="sigma">Standard deviation</param>
+  /// <param name="radius">Kernel radius</param>
+  static void separableLoG(const float* img, double* out, int width,
+                           int height, float sigma, int radius);
 
   /// <summary>
   /// Convolutes image with 2D kernel.
@@ -77,8 +77,14 @@
 
 #define ERR_CONSTANT 0.01f
 #define ITERATIONS 20
+#define SOR_MAX_ITERATIONS 10000
 
-#define ORIG_WHITE_ERR 0.985f
+// AVX2 kernels are always compiled and selected at runtime by Utils::hasAVX2
+#if defined(_MSC_VER)
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
 
 #define EXPONENT 9.0f
 
@@ -214,4 +220,20 @@ enum Mode { DRAW = 0, DEPTH, PICK, BLOCK };
 
 enum ModalFlags { FSL = 0, FH, FRGB };
 
+/// <summary>
+/// Byte labels of the pixels in the selection of a filled segment. They
+/// replace the float images with the values -1, 0, 1 and 0.5.
+/// </summary>
+enum PixelLabel : BYTE { PX_EMPTY = 0, PX_BLACK, PX_WHITE, PX_GREY };
+
+/// <summary>
+/// Value of the labelled pixel in the linear system.
+/// </summary>
+/// <param name="label">Pixel label</param>
+/// <returns>Boundary value, 0.5 for unknown and -1 for empty pixels</returns>
+inline float labelValue(BYTE label) {
+  static const float values[] = {-1.0f, 0.0f, 1.0f, 0.5f};
+  return values[label];
+}
+
 #endif  // !__DEFINES
\ No newline at end of file
@@ -39,11 +39,15 @@
 #include <sstream>
 
 #include "AllegroOperations.h"
+#include "ColorKernels.h"
 #include "ColorSegments.h"
 #include "Depth.h"
+#include "ImageCache.h"
 #include "ShapeFill.h"
 #include "Utils.h"
 
+//#define TIME_MEASURE
+
 /// <summary>
 /// Draws an arrow to selected coordinates with bordering and filling color.
 /// </summary>
@@ -166,7 +170,8 @@ void graphCut(ALLEGRO_BITMAP* screen, ColorMap& c_map,
 /// <param name="c_map">Color map</param>
 /// <param name="depth">Depth data</param>
 /// <param name="scribbles">Scribble data map</param>
-void checkScribbles(ColorMap& c_map, Depth& depth, short* scribbles) {
+/// <returns>Whether the scribble indices changed</returns>
+bool checkScribbles(ColorMap& c_map, Depth& depth, short* scribbles) {
   std::set<BYTE> marks[2];
   std::map<BYTE, BYTE> changes;
   for (int h = 0; h < c_map.getHeight(); h++) {
@@ -194,6 +199,7 @@ void checkScribbles(ColorMap& c_map, Depth& depth, short* scribbles) {
         scribbles[i] = changes[scribbles[i]];
       }
   }
+  return reset;
 }
 
 /// <summary>
@@ -355,6 +361,9 @@ void saveScreen(ALLEGRO_BITMAP* screen, std::string append = "") {
 
 int main(int argc, char* argv[]) {
   _CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
+#ifdef _DEBUG
+  ColorKernels::selfTest();
+#endif  // _DEBUG
   {
     ALLEGRO_DISPLAY* display = nullptr;
     ALLEGRO_EVENT_QUEUE* queue = nullptr;
@@ -394,6 +403,7 @@ int main(int argc, char* argv[]) {
     BYTE* block = new BYTE[intensityImg.width() * intensityImg.height()];
     for (int i = 0; i < intensityImg.width() * intensityImg.height(); i++)
       block[i] = 0;
+    DirtyRects dirty;
 
     std::cout << (scrFlags & 1 ? "Soft scribbles" : "Hard scribbles") << std::endl;
     std::cout << (scrFlags & 2 ? "Colors locked" : "Colors unlocked") << std::endl;
@@ -403,7 +413,8 @@ int main(int argc, char* argv[]) {
               << "Draw mode" << std::endl;
     al_start_timer(timer);
 
-    set_screen(intensityImg, c_map, screen, scribbleData, block, displayFlags);
+    set_screen(intensityImg, c_map, screen, scribbleData, block, displayFlags,
+               dirty);
 
     // Main loop
     while (true) {
@@ -465,7 +476,7 @@ int main(int argc, char* argv[]) {
           if (event.mouse.button == mouse_bs) {
             if (mode == DRAW) {
               al_reset_clipping_rectangle();
-              checkScribbles(c_map, depth, scribbleData);
+              if (checkScribbles(c_map, depth, scribbleData)) dirty.addAll();
               depth.update(
                   (scrFlags & MASK_SCRIBBLE_TYPE) * 128 +
                   c_map.getScribbleCount()[scrFlags & MASK_SCRIBBLE_TYPE] - 1);
@@ -516,19 +527,24 @@ int main(int argc, char* argv[]) {
                 for (int h = minc.y; h <= maxc.y; h++)
                   for (int w = minc.x; w <= maxc.x; w++)
                     block[w + h * intensityImg.width()] = mouse_bs;
+                dirty.add(minc.x, minc.y, maxc.x + 1, maxc.y + 1);
                 fromToCoords[0].x = -1;
                 inProcess = false;
               }
             }
             mouse_bs = REL;
           }
-          set_screen(intensityImg, c_map, screen, scribbleData, block, displayFlags);
+          set_screen(intensityImg, c_map, screen, scribbleData, block,
+                     displayFlags, dirty);
         }
         if (mouse_bs != REL && mode == DRAW && key == 0) {
           if (xy_old != xy) {
             circleFillAllegro(xy.x, xy.y, screen, scribbleData, RADIUS,
                               c_map.getColors()[c_map.getActive()],
                               c_map.getActive());
+            // neighbours of the stroke may become scribble borders
+            dirty.add(xy.x - RADIUS - 1, xy.y - RADIUS - 1, xy.x + RADIUS + 2,
+                      xy.y + RADIUS + 2);
             xy_old = xy;
           }
         }
@@ -549,8 +565,9 @@ int main(int argc, char* argv[]) {
           // map scribbles to the regions, run graph cut
           if (al_key_down(&keyState, ALLEGRO_KEY_M)) {
             graphCut(screen, c_map, intensityImg, scribbleData);
+            dirty.addAll();
             set_screen(intensityImg, c_map, screen, scribbleData, block,
-                       displayFlags);
+                       displayFlags, dirty);
             key = ALLEGRO_KEY_M;
           }
 
@@ -562,21 +579,31 @@ int main(int argc, char* argv[]) {
                          name);
             key = ALLEGRO_KEY_O;
             std::cout << "Done\n";
+#ifdef TIME_MEASURE
+            for (const auto& s : sf.solverStats()) {
+              std::cout << "Segment " << (int)s.first << ": "
+                        << s.second.iterations << " iterations, residual "
+                        << s.second.residual
+                        << (s.second.converged ? "" : " (budget reached)")
+                        << ", " << s.second.time << " ms\n";
+            }
+            std::cout << "Image data copied so far: "
+                      << imageBytesCopied() / (1024 * 1024) << " MB\n";
+#endif  // TIME_MEASURE
           }
 
           // reset application
           if (al_key_down(&keyState, ALLEGRO_KEY_R)) {
+            dirty.addAll();
             if (shiftDown) {
-              intensityImg = imread<float>(FOLDER + filename);
-              Utils::scaleAndPad(intensityImg);
+              intensityImg = *ImageCache::source(FOLDER + filename);
             } else {
               reset(screen);
               for (int i = 0; i < intensityImg.width() * intensityImg.height();
                    i++)
                 block[i] = 0;
               // reset intensity image
-              intensityImg = imread<float>(FOLDER + filename);
-              Utils::scaleAndPad(intensityImg);
+              intensityImg = *ImageCache::source(FOLDER + filename);
               c_map.reset();
               depth.reset(c_map.getScribbleCount());
               ColorSegments::createBackgroundScribbles(
@@ -585,7 +612,7 @@ int main(int argc, char* argv[]) {
               std::cout << "Draw mode\n";
             }
             set_screen(intensityImg, c_map, screen, scribbleData, block,
-                       displayFlags);
+                       displayFlags, dirty);
             key = ALLEGRO_KEY_R;
           }
 
@@ -630,8 +657,9 @@ int main(int argc, char* argv[]) {
               for (int i = 0; i < intensityImg.width() * intensityImg.height();
                    i++)
                 block[i] = 0;
+              dirty.addAll();
               set_screen(intensityImg, c_map, screen, scribbleData, block,
-                         displayFlags);
+                         displayFlags, dirty);
             } else {
               mode = mode == BLOCK ? DRAW : BLOCK;
               std::cout << (mode == DRAW ? "Draw mode" : "Merge blocking mode")
@@ -650,8 +678,9 @@ int main(int argc, char* argv[]) {
 
           if (al_key_down(&keyState, ALLEGRO_KEY_A)) {
             displayFlags = (displayFlags + 1) % 4;
+            dirty.addAll();
             set_screen(intensityImg, c_map, screen, scribbleData, block,
-                       displayFlags);
+                       displayFlags, dirty);
             key = ALLEGRO_KEY_A;
           }
 
@@ -659,8 +688,9 @@ int main(int argc, char* argv[]) {
           if (al_key_down(&keyState, ALLEGRO_KEY_X)) {
             load(c_map, scribbleData, block, intensityImg, depth, filename,
                  name);
+            dirty.addAll();
             set_screen(intensityImg, c_map, screen, scribbleData, block,
-                       displayFlags);
+                       displayFlags, dirty);
             std::cout << "Done\n";
             key = ALLEGRO_KEY_X;
           }
@@ -702,16 +732,18 @@ int main(int argc, char* argv[]) {
           // add contrast for computations
           if (al_key_down(&keyState, ALLEGRO_KEY_K) && mode == DRAW) {
             Utils::gammaCorrection(intensityImg, 2);
+            dirty.addAll();
             set_screen(intensityImg, c_map, screen, scribbleData, block,
-                       displayFlags);
+                       displayFlags, dirty);
             key = ALLEGRO_KEY_K;
           }
 
           // blurAndTreshold image
           if (al_key_down(&keyState, ALLEGRO_KEY_B) && mode == DRAW) {
-            Utils::blur(intensityImg, 1);
+            Utils::blur(intensityImg, 1, BLUR_IIR);
+            dirty.addAll();
             set_screen(intensityImg, c_map, screen, scribbleData, block,
-                       displayFlags);
+                       displayFlags, dirty);
             key = ALLEGRO_KEY_B;
           }
         }